@@ -1,9 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <new>
 #include <string.h>
 #include <time.h>
 #include <stdint.h>
+#include <assert.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#elif defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define HAS_X86_64 1
+#endif
 
 static constexpr auto SEARCH_DEPTH = 8;
 
@@ -45,37 +62,435 @@ struct Piece
 	PieceType type() const { return (PieceType)(info & ~Team::BLACK); }
 };
 
-enum MoveFlags
+// Bit i of a bitboard stands for board[i], that is row i / 8 and col i % 8.
+using Bitboard = uint64_t;
+
+static constexpr auto PIECE_TYPES_COUNT = 6;
+
+inline Bitboard square_bb(uint8_t square) { return 1ULL << square; }
+
+inline int popcount(Bitboard bb) {
+#ifdef _MSC_VER
+	return (int)__popcnt64(bb);
+#else
+	return __builtin_popcountll(bb);
+#endif
+}
+
+// Undefined for an empty bitboard.
+inline uint8_t lsb(Bitboard bb) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, bb);
+	return (uint8_t)index;
+#else
+	return (uint8_t)__builtin_ctzll(bb);
+#endif
+}
+
+inline uint8_t pop_lsb(Bitboard& bb) {
+	uint8_t square = lsb(bb);
+	bb &= bb - 1;
+	return square;
+}
+
+// Maps KING..PAWN to 0..5, to index per-type tables.
+inline uint8_t type_index(PieceType type) { return lsb(type) - 1; }
+
+struct SquareTable
 {
-	NO_ACTION = 0,
-	ATTACK = 1,
-	// Possible attacks of:
-	// KING = 2,
-	// QUEEN = 4,
-	// ROOK = 8,
-	// BISHOP = 16,
-	// KNIGHT = 32,
-	// PAWN = 64,
-	FIRST_MOVE = 128,
-	CASTLE_LEFT_BEFORE_MOVE = 256,
-	CASTLE_RIGHT_BEFORE_MOVE = 512,
-	PROMOTION = 1024,
-	DOUBLE_MOVE = 2048,
-	EN_PASSANT = 4096,
+	Bitboard squares[64];
+	constexpr Bitboard operator[](uint8_t square) const { return squares[square]; }
 };
 
-struct Move
+constexpr SquareTable make_step_table(const int8_t steps[][2], int steps_count) {
+	SquareTable table{};
+	for (int square = 0; square < 64; ++square) {
+		for (int i = 0; i < steps_count; ++i) {
+			int col = square % 8 + steps[i][0];
+			int row = square / 8 + steps[i][1];
+			if (col >= 0 && col < 8 && row >= 0 && row < 8)
+				table.squares[square] |= 1ULL << (row * 8 + col);
+		}
+	}
+	return table;
+}
+
+static constexpr int8_t knight_steps[8][2] = { { 1, 2 }, { 1, -2 }, { -1, 2 }, { -1, -2 }, { 2, 1 }, { 2, -1 }, { -2, 1 }, { -2, -1 } };
+static constexpr int8_t king_steps[8][2] = { { -1, -1 }, { 0, -1 }, { 1, -1 }, { -1, 0 }, { 1, 0 }, { -1, 1 }, { 0, 1 }, { 1, 1 } };
+// White pawns advance towards row 0, black pawns towards row 7.
+static constexpr int8_t white_pawn_steps[2][2] = { { -1, -1 }, { 1, -1 } };
+static constexpr int8_t black_pawn_steps[2][2] = { { -1, 1 }, { 1, 1 } };
+
+static constexpr SquareTable knight_attacks = make_step_table(knight_steps, 8);
+static constexpr SquareTable king_attacks = make_step_table(king_steps, 8);
+// Squares a pawn of each team attacks, indexed by Team.
+static constexpr SquareTable pawn_attacks[2] = { make_step_table(white_pawn_steps, 2), make_step_table(black_pawn_steps, 2) };
+
+// Slow ray walk, used only to build the attack tables.
+Bitboard sliding_attacks(const int8_t directions[4][2], uint8_t square, Bitboard occupied) {
+	Bitboard result = 0;
+	for (int i = 0; i < 4; ++i) {
+		int8_t col_dir = directions[i][0];
+		int8_t row_dir = directions[i][1];
+		for (int8_t c = square % 8 + col_dir, r = square / 8 + row_dir; c < 8 && r < 8 && c > -1 && r > -1; c += col_dir, r += row_dir) {
+			Bitboard bb = square_bb(r * 8 + c);
+			result |= bb;
+			if (occupied & bb)
+				break;
+		}
+	}
+	return result;
+}
+
+static const int8_t rook_directions[4][2] = { { 0, -1 }, { 0, 1 }, { 1, 0 }, { -1, 0 } };
+static const int8_t bishop_directions[4][2] = { { -1, -1 }, { 1, 1 }, { 1, -1 }, { -1, 1 } };
+
+// Set once at startup by init_attack_tables, when the CPU has a fast PEXT.
+static bool use_pext = false;
+
+// MSVC lets BMI2 intrinsics be used anywhere. GCC and Clang only allow
+// them in functions built for BMI2, which cannot be inlined into the rest,
+// so the instruction is written out to keep it inline at every lookup.
+inline uint64_t pext(uint64_t value, uint64_t mask) {
+#if defined(HAS_X86_64) && defined(_MSC_VER)
+	return _pext_u64(value, mask);
+#elif defined(HAS_X86_64)
+	uint64_t result;
+	__asm__("pextq %2, %1, %0" : "=r"(result) : "r"(value), "rm"(mask));
+	return result;
+#else
+	return 0; // Never called, use_pext stays false.
+#endif
+}
+
+#ifdef HAS_X86_64
+// Fills regs with eax, ebx, ecx and edx of the given CPUID leaf.
+inline void cpuid(unsigned int leaf, unsigned int subleaf, unsigned int regs[4]) {
+#ifdef _MSC_VER
+	__cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+#endif
+
+// BMI2 alone is not enough: AMD before Zen 3, and Hygon which is built on
+// Zen 1, run PEXT in microcode, far slower than a magic multiplication.
+bool cpu_has_fast_pext() {
+#ifdef HAS_X86_64
+	unsigned int regs[4]; // eax, ebx, ecx, edx
+	cpuid(0, 0, regs);
+	if (regs[0] < 7)
+		return false;
+	bool is_amd = regs[1] == 0x68747541; // "Auth" of "AuthenticAMD".
+	bool is_hygon = regs[1] == 0x6F677948; // "Hygo" of "HygonGenuine".
+
+	cpuid(7, 0, regs);
+	bool has_bmi2 = regs[1] & (1 << 8);
+	if (!has_bmi2 || is_hygon)
+		return false;
+	if (!is_amd)
+		return true;
+
+	cpuid(1, 0, regs);
+	unsigned int family = (regs[0] >> 8) & 0xF;
+	if (family == 0xF)
+		family += (regs[0] >> 20) & 0xFF;
+	return family >= 0x19;
+#else
+	return false;
+#endif
+}
+
+// AVX2 needs the OS to save the YMM registers as well as the CPU flag.
+#if defined(HAS_X86_64) && !defined(_MSC_VER)
+__attribute__((target("xsave")))
+#endif
+bool cpu_has_avx2() {
+#ifdef HAS_X86_64
+	unsigned int regs[4]; // eax, ebx, ecx, edx
+	cpuid(0, 0, regs);
+	if (regs[0] < 7)
+		return false;
+
+	cpuid(1, 0, regs);
+	bool has_osxsave = regs[2] & (1 << 27);
+	if (!has_osxsave || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	cpuid(7, 0, regs);
+	return regs[1] & (1 << 5);
+#else
+	return false;
+#endif
+}
+
+// "Fancy" magic bitboards: the relevant occupancy of a square is hashed by
+// a multiplication into its own slice of a shared attack table. With PEXT
+// the occupancy bits are gathered directly and magic is left unused.
+struct Magic
 {
-	uint8_t source{};
-	uint8_t destination{};
-	MoveFlags flags{};
+	Bitboard mask;
+	Bitboard magic;
+	Bitboard* attacks;
+	uint8_t shift;
+	inline uint32_t index(Bitboard occupied) const {
+		if (use_pext)
+			return (uint32_t)pext(occupied, mask);
+		return (uint32_t)(((occupied & mask) * magic) >> shift);
+	}
+};
+
+static Magic rook_magics[64];
+static Magic bishop_magics[64];
+static Bitboard rook_table[0x19000];
+static Bitboard bishop_table[0x1480];
+
+inline Bitboard rook_attacks(uint8_t square, Bitboard occupied) {
+	const Magic& m = rook_magics[square];
+	return m.attacks[m.index(occupied)];
+}
+
+inline Bitboard bishop_attacks(uint8_t square, Bitboard occupied) {
+	const Magic& m = bishop_magics[square];
+	return m.attacks[m.index(occupied)];
+}
+
+inline Bitboard queen_attacks(uint8_t square, Bitboard occupied) {
+	return rook_attacks(square, occupied) | bishop_attacks(square, occupied);
+}
+
+inline uint64_t xorshift64star(uint64_t& state) {
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 2685821657736338717ULL;
+}
+
+void init_magics(Magic magics[64], Bitboard* table, const int8_t directions[4][2]) {
+	const Bitboard rows_edges = 0xFF000000000000FFULL;
+	const Bitboard cols_edges = 0x8181818181818181ULL;
+	Bitboard occupancy[4096];
+	Bitboard reference[4096];
+	int epoch[4096] = {};
+	int current_epoch = 0;
+	// Per-row seeds known to find all the magics quickly.
+	const uint64_t seeds[8] = { 728, 10316, 55013, 32803, 12281, 15100, 16645, 255 };
+
+	for (uint8_t square = 0; square < 64; ++square) {
+		Bitboard row_bb = 0xFFULL << (square / 8 * 8);
+		Bitboard col_bb = 0x0101010101010101ULL << (square % 8);
+		Bitboard edges = (rows_edges & ~row_bb) | (cols_edges & ~col_bb);
+
+		Magic& m = magics[square];
+		m.mask = sliding_attacks(directions, square, 0) & ~edges;
+		m.shift = (uint8_t)(64 - popcount(m.mask));
+		m.attacks = square == 0 ? table : magics[square - 1].attacks + (1 << (64 - magics[square - 1].shift));
+
+		// Enumerate all subsets of the mask (Carry-Rippler trick).
+		int size = 0;
+		Bitboard subset = 0;
+		do {
+			occupancy[size] = subset;
+			reference[size] = sliding_attacks(directions, square, subset);
+			++size;
+			subset = (subset - m.mask) & m.mask;
+		} while (subset);
+
+		if (use_pext) {
+			for (int i = 0; i < size; ++i)
+				m.attacks[m.index(occupancy[i])] = reference[i];
+			continue;
+		}
+
+		// Try sparse random numbers until one maps every subset without
+		// a destructive collision.
+		uint64_t seed = seeds[square / 8];
+		for (int i = 0; i < size;) {
+			do {
+				m.magic = xorshift64star(seed) & xorshift64star(seed) & xorshift64star(seed);
+			} while (popcount((m.mask * m.magic) >> 56) < 6);
+
+			++current_epoch;
+			for (i = 0; i < size; ++i) {
+				uint32_t index = m.index(occupancy[i]);
+				if (epoch[index] < current_epoch) {
+					epoch[index] = current_epoch;
+					m.attacks[index] = reference[i];
+				} else if (m.attacks[index] != reference[i])
+					break;
+			}
+		}
+	}
+}
+
+// Squares strictly between two aligned squares, and the whole line through
+// them (both included). Empty when the squares are not aligned.
+static Bitboard between_bb[64][64];
+static Bitboard line_bb[64][64];
 
-	PieceType get_attacked_piece_type() { return (PieceType)(flags & Type_Mask); }
+void init_lines() {
+	for (uint8_t a = 0; a < 64; ++a) {
+		for (uint8_t b = 0; b < 64; ++b) {
+			if (a == b)
+				continue;
+			if (rook_attacks(a, 0) & square_bb(b)) {
+				between_bb[a][b] = rook_attacks(a, square_bb(b)) & rook_attacks(b, square_bb(a));
+				line_bb[a][b] = (rook_attacks(a, 0) & rook_attacks(b, 0)) | square_bb(a) | square_bb(b);
+			} else if (bishop_attacks(a, 0) & square_bb(b)) {
+				between_bb[a][b] = bishop_attacks(a, square_bb(b)) & bishop_attacks(b, square_bb(a));
+				line_bb[a][b] = (bishop_attacks(a, 0) & bishop_attacks(b, 0)) | square_bb(a) | square_bb(b);
+			}
+		}
+	}
+}
+
+static constexpr Bitboard NOT_COL_0 = ~0x0101010101010101ULL;
+static constexpr Bitboard NOT_COL_7 = ~0x8080808080808080ULL;
+
+// Kogge-Stone occluded fills: every square the sliders reach along one
+// direction, the first occupied square included, in three doubling steps
+// and without any table. A direction moves a square by shift, upward
+// (to higher squares) or downward; mask drops the squares that would wrap
+// around to the other side of the board.
+inline Bitboard fill_up(Bitboard sliders, Bitboard empty, int shift, Bitboard mask) {
+	empty &= mask;
+	sliders |= empty & (sliders << shift);
+	empty &= empty << shift;
+	sliders |= empty & (sliders << (shift * 2));
+	empty &= empty << (shift * 2);
+	sliders |= empty & (sliders << (shift * 4));
+	return (sliders << shift) & mask;
+}
+
+inline Bitboard fill_down(Bitboard sliders, Bitboard empty, int shift, Bitboard mask) {
+	empty &= mask;
+	sliders |= empty & (sliders >> shift);
+	empty &= empty >> shift;
+	sliders |= empty & (sliders >> (shift * 2));
+	empty &= empty >> (shift * 2);
+	sliders |= empty & (sliders >> (shift * 4));
+	return (sliders >> shift) & mask;
+}
+
+// All the squares attacked by the orthogonal (rook, queen) and diagonal
+// (bishop, queen) sliders together.
+Bitboard slider_attack_map_scalar(Bitboard orthogonal, Bitboard diagonal, Bitboard empty) {
+	return fill_up(orthogonal, empty, 1, NOT_COL_0) | fill_up(orthogonal, empty, 8, ~0ULL)
+		| fill_up(diagonal, empty, 9, NOT_COL_0) | fill_up(diagonal, empty, 7, NOT_COL_7)
+		| fill_down(orthogonal, empty, 1, NOT_COL_7) | fill_down(orthogonal, empty, 8, ~0ULL)
+		| fill_down(diagonal, empty, 9, NOT_COL_7) | fill_down(diagonal, empty, 7, NOT_COL_0);
+}
+
+// Same as slider_attack_map_scalar, with the four upward directions in the
+// lanes of one register and the four downward ones in another.
+#if defined(HAS_X86_64) && !defined(_MSC_VER)
+__attribute__((target("avx2")))
+#endif
+Bitboard slider_attack_map_avx2(Bitboard orthogonal, Bitboard diagonal, Bitboard empty) {
+#ifdef HAS_X86_64
+	const __m256i shift = _mm256_set_epi64x(7, 9, 8, 1);
+	const __m256i shift2 = _mm256_set_epi64x(14, 18, 16, 2);
+	const __m256i shift4 = _mm256_set_epi64x(28, 36, 32, 4);
+	const __m256i up_mask = _mm256_set_epi64x(NOT_COL_7, NOT_COL_0, ~0ULL, NOT_COL_0);
+	const __m256i down_mask = _mm256_set_epi64x(NOT_COL_0, NOT_COL_7, ~0ULL, NOT_COL_7);
+	const __m256i sliders = _mm256_set_epi64x(diagonal, diagonal, orthogonal, orthogonal);
+	const __m256i all_empty = _mm256_set1_epi64x(empty);
+
+	__m256i up = sliders;
+	__m256i up_empty = _mm256_and_si256(all_empty, up_mask);
+	up = _mm256_or_si256(up, _mm256_and_si256(up_empty, _mm256_sllv_epi64(up, shift)));
+	up_empty = _mm256_and_si256(up_empty, _mm256_sllv_epi64(up_empty, shift));
+	up = _mm256_or_si256(up, _mm256_and_si256(up_empty, _mm256_sllv_epi64(up, shift2)));
+	up_empty = _mm256_and_si256(up_empty, _mm256_sllv_epi64(up_empty, shift2));
+	up = _mm256_or_si256(up, _mm256_and_si256(up_empty, _mm256_sllv_epi64(up, shift4)));
+	up = _mm256_and_si256(_mm256_sllv_epi64(up, shift), up_mask);
+
+	__m256i down = sliders;
+	__m256i down_empty = _mm256_and_si256(all_empty, down_mask);
+	down = _mm256_or_si256(down, _mm256_and_si256(down_empty, _mm256_srlv_epi64(down, shift)));
+	down_empty = _mm256_and_si256(down_empty, _mm256_srlv_epi64(down_empty, shift));
+	down = _mm256_or_si256(down, _mm256_and_si256(down_empty, _mm256_srlv_epi64(down, shift2)));
+	down_empty = _mm256_and_si256(down_empty, _mm256_srlv_epi64(down_empty, shift2));
+	down = _mm256_or_si256(down, _mm256_and_si256(down_empty, _mm256_srlv_epi64(down, shift4)));
+	down = _mm256_and_si256(_mm256_srlv_epi64(down, shift), down_mask);
+
+	__m256i both = _mm256_or_si256(up, down);
+	__m128i half = _mm_or_si128(_mm256_castsi256_si128(both), _mm256_extracti128_si256(both, 1));
+	return (Bitboard)_mm_cvtsi128_si64(half) | (Bitboard)_mm_extract_epi64(half, 1);
+#else
+	return 0; // Never called, use_avx2 stays false.
+#endif
+}
+
+// Set once at startup by init_attack_tables, when the CPU supports AVX2.
+static bool use_avx2 = false;
+
+inline Bitboard slider_attack_map(Bitboard orthogonal, Bitboard diagonal, Bitboard empty) {
+	if (use_avx2)
+		return slider_attack_map_avx2(orthogonal, diagonal, empty);
+	return slider_attack_map_scalar(orthogonal, diagonal, empty);
+}
+
+void init_attack_tables() {
+	use_pext = cpu_has_fast_pext();
+	use_avx2 = cpu_has_avx2();
+	init_magics(rook_magics, rook_table, rook_directions);
+	init_magics(bishop_magics, bishop_table, bishop_directions);
+	init_lines();
+}
+
+enum MoveKind
+{
+	NORMAL = 0,
+	PROMOTION = 1,
+	EN_PASSANT = 2,
+	CASTLING = 3,
 };
 
+// A move packed in 16 bits: source in bits 0-5, destination in bits 6-11,
+// promotion piece in bits 12-13 and MoveKind in bits 14-15. What is needed
+// to undo it is kept apart, in an UndoRecord.
+struct Move
+{
+	uint16_t data{};
+	Move() = default;
+	Move(uint8_t source, uint8_t destination, MoveKind kind = MoveKind::NORMAL, PieceType promotion = PieceType::KNIGHT)
+		: data((uint16_t)(source | (destination << 6) | ((5 - lsb(promotion)) << 12) | (kind << 14))) {}
+
+	inline uint8_t source() const { return data & 0x3F; }
+	inline uint8_t destination() const { return (data >> 6) & 0x3F; }
+	inline MoveKind kind() const { return (MoveKind)(data >> 14); }
+	// Only meaningful for MoveKind::PROMOTION.
+	inline PieceType promotion_type() const { return (PieceType)(PieceType::KNIGHT >> ((data >> 12) & 3)); }
+	bool operator==(const Move& other) const { return data == other.data; }
+	bool operator!=(const Move& other) const { return data != other.data; }
+};
+
+// No real move has the same source and destination.
+static const Move NO_MOVE = Move{};
+
+// Writes move the way the board is labelled, like "g1 e1", with the
+// promotion piece appended. out must hold at least 7 characters.
+void move_to_string(Move move, char* out) {
+	int length = sprintf(out, "%c%c %c%c", (char)('a' + move.source() / 8), (char)('1' + move.source() % 8),
+		(char)('a' + move.destination() / 8), (char)('1' + move.destination() % 8));
+	if (move.kind() == MoveKind::PROMOTION) {
+		switch (move.promotion_type()) {
+		case PieceType::QUEEN: out[length] = 'q'; break;
+		case PieceType::ROOK: out[length] = 'r'; break;
+		case PieceType::BISHOP: out[length] = 'b'; break;
+		default: out[length] = 'n'; break;
+		}
+		out[length + 1] = '\0';
+	}
+}
+
 void print_move(Move move) {
-	printf("%c%c %c%c\n", (char)('a' + move.source / 8), (char)('1' + move.source % 8),
-		(char)('a' + move.destination / 8), (char)('1' + move.destination % 8));
+	char text[8];
+	move_to_string(move, text);
+	printf("%s\n", text);
 }
 
 enum GameFlags
@@ -86,173 +501,527 @@ enum GameFlags
 	CAN_BLACK_CASTLE_LEFT = 8
 };
 
+static const auto INVALID_POSITION = (uint8_t)-1;
+
+// Zobrist keys: a position's key is the xor of the keys of everything in
+// it, so a move updates it by xoring in and out just what it changed.
+static uint64_t zobrist_pieces[2][PIECE_TYPES_COUNT][64];
+static uint64_t zobrist_castling[16];
+static uint64_t zobrist_en_passant_col[8];
+static uint64_t zobrist_black_to_move;
+
+void init_zobrist() {
+	uint64_t seed = 1070372;
+	for (int team = 0; team < 2; ++team)
+		for (int type = 0; type < PIECE_TYPES_COUNT; ++type)
+			for (int square = 0; square < 64; ++square)
+				zobrist_pieces[team][type][square] = xorshift64star(seed);
+	for (int flags = 0; flags < 16; ++flags)
+		zobrist_castling[flags] = xorshift64star(seed);
+	for (int col = 0; col < 8; ++col)
+		zobrist_en_passant_col[col] = xorshift64star(seed);
+	zobrist_black_to_move = xorshift64star(seed);
+}
+
+inline uint64_t piece_key(Piece piece, uint8_t square) {
+	return zobrist_pieces[piece.team()][type_index(piece.type())][square];
+}
+
+// The material key has a term for each piece of a kind, the square keys
+// standing for the first, second... piece of that kind, so it only
+// depends on how many pieces of each kind there are.
+inline uint64_t material_key_term(Piece piece, uint8_t index) {
+	return zobrist_pieces[piece.team()][type_index(piece.type())][index];
+}
+
+// The part of a position that cannot be worked back out when a move is
+// taken back. make_move saves it whole and unmake_move restores it with a
+// single copy, so anything added here needs no undo logic of its own.
+struct IrreversibleState
+{
+	// See zobrist_pieces.
+	uint64_t key;
+	// The part of key from the pawns alone.
+	uint64_t pawn_key;
+	// See material_key_term.
+	uint64_t material_key;
+	GameFlags flags;
+	// The square a pawn skipped over with a double move on the last move,
+	// INVALID_POSITION otherwise.
+	uint8_t en_passant_square;
+	// Moves since the last capture or pawn move, for the fifty-move rule.
+	uint8_t halfmove_clock;
+	// White's material minus black's, see piece_values.
+	int16_t material;
+};
+
+// What make_move overwrites, for unmake_move.
+struct UndoRecord
+{
+	Piece captured;
+	IrreversibleState state;
+};
+
+// The moves played in a game, growing as the game goes on. The search
+// never touches it, see SearchStack.
 struct MoveHistory
 {
-	Move moves[512];
-	int cursor = 0;
-	inline void add(Move to_add) { moves[cursor++] = to_add; }
-	inline Move pop() {
-		return moves[--cursor];
+	std::vector<Move> moves;
+	std::vector<UndoRecord> undo_records;
+	inline int size() const { return (int)moves.size(); }
+	inline void add(Move to_add, UndoRecord undo) {
+		moves.push_back(to_add);
+		undo_records.push_back(undo);
+	}
+	inline Move pop(UndoRecord* out_undo) {
+		Move move = moves.back();
+		*out_undo = undo_records.back();
+		moves.pop_back();
+		undo_records.pop_back();
+		return move;
+	}
+	inline Move peek() const { return moves.back(); }
+	inline void clear() {
+		moves.clear();
+		undo_records.clear();
 	}
-	inline Move peek() { return moves[cursor - 1]; }
 };
 
-struct ChessGame
+// Everything the move generator and the search look at, and nothing else,
+// so that it is cheap enough to copy once per ply (see minimax). The
+// mailbox and the bitboards take a cache line each, so three lines is as
+// small as it gets while the generator reads both. Aligned so that it
+// never straddles a fourth.
+struct alignas(64) Position
 {
-	bool is_against_ai;
-	GameFlags flags{};
+	IrreversibleState state{};
 	Team current_turn;
 	Piece board[8 * 8];
-	MoveHistory history;
+	// Kept in sync with board by put_piece, remove_piece and move_piece.
+	Bitboard pieces_by_type[PIECE_TYPES_COUNT];
+	Bitboard pieces_by_team[2];
+	uint8_t piece_counts[2][PIECE_TYPES_COUNT];
+	uint8_t king_squares[2];
 	inline Piece piece_at(int8_t col, int8_t row) { return board[row * 8 + col]; }
-	inline bool can_castle_right(bool is_white) { return is_white ? flags & GameFlags::CAN_WHITE_CASTLE_RIGHT : flags & GameFlags::CAN_BLACK_CASTLE_RIGHT; }
+	inline Bitboard occupied() const { return pieces_by_team[Team::WHITE] | pieces_by_team[Team::BLACK]; }
+	inline Bitboard pieces(PieceType type) const { return pieces_by_type[type_index(type)]; }
+	inline Bitboard pieces(PieceType type, Team team) const { return pieces(type) & pieces_by_team[team]; }
+	inline void put_piece(uint8_t square, Piece piece) {
+		Bitboard bb = square_bb(square);
+		uint8_t index = type_index(piece.type());
+		board[square] = piece;
+		pieces_by_type[index] |= bb;
+		pieces_by_team[piece.team()] |= bb;
+		++piece_counts[piece.team()][index];
+		if (piece.type() == PieceType::KING)
+			king_squares[piece.team()] = square;
+	}
+	inline void remove_piece(uint8_t square) {
+		Piece piece = board[square];
+		Bitboard bb = square_bb(square);
+		uint8_t index = type_index(piece.type());
+		board[square] = Piece(PieceType::NONE);
+		pieces_by_type[index] &= ~bb;
+		pieces_by_team[piece.team()] &= ~bb;
+		--piece_counts[piece.team()][index];
+	}
+	// The destination must be empty.
+	inline void move_piece(uint8_t source, uint8_t destination) {
+		Piece piece = board[source];
+		Bitboard bb = square_bb(source) | square_bb(destination);
+		board[destination] = piece;
+		board[source] = Piece(PieceType::NONE);
+		pieces_by_type[type_index(piece.type())] ^= bb;
+		pieces_by_team[piece.team()] ^= bb;
+		if (piece.type() == PieceType::KING)
+			king_squares[piece.team()] = destination;
+	}
+	inline uint8_t count(PieceType type, Team team) const { return piece_counts[team][type_index(type)]; }
+	inline bool can_castle_right(bool is_white) { return is_white ? state.flags & GameFlags::CAN_WHITE_CASTLE_RIGHT : state.flags & GameFlags::CAN_BLACK_CASTLE_RIGHT; }
 	inline void set_castle_right(bool value, bool is_white) {
 		if (is_white)
 			if (value)
-				flags = (GameFlags)(flags | GameFlags::CAN_WHITE_CASTLE_RIGHT);
+				state.flags = (GameFlags)(state.flags | GameFlags::CAN_WHITE_CASTLE_RIGHT);
 			else
-				flags = (GameFlags)(flags & ~GameFlags::CAN_WHITE_CASTLE_RIGHT);
+				state.flags = (GameFlags)(state.flags & ~GameFlags::CAN_WHITE_CASTLE_RIGHT);
 		else
 			if (value)
-				flags = (GameFlags)(flags | GameFlags::CAN_BLACK_CASTLE_RIGHT);
+				state.flags = (GameFlags)(state.flags | GameFlags::CAN_BLACK_CASTLE_RIGHT);
 			else
-				flags = (GameFlags)(flags & ~GameFlags::CAN_BLACK_CASTLE_RIGHT);
+				state.flags = (GameFlags)(state.flags & ~GameFlags::CAN_BLACK_CASTLE_RIGHT);
 	}
-	inline bool can_castle_left(bool is_white) { return is_white ? flags & GameFlags::CAN_WHITE_CASTLE_LEFT : flags & GameFlags::CAN_BLACK_CASTLE_LEFT; }
+	inline bool can_castle_left(bool is_white) { return is_white ? state.flags & GameFlags::CAN_WHITE_CASTLE_LEFT : state.flags & GameFlags::CAN_BLACK_CASTLE_LEFT; }
 	inline void set_castle_left(bool value, bool is_white) {
 		if (is_white)
 			if (value)
-				flags = (GameFlags)(flags | GameFlags::CAN_WHITE_CASTLE_LEFT);
+				state.flags = (GameFlags)(state.flags | GameFlags::CAN_WHITE_CASTLE_LEFT);
 			else
-				flags = (GameFlags)(flags & ~GameFlags::CAN_WHITE_CASTLE_LEFT);
+				state.flags = (GameFlags)(state.flags & ~GameFlags::CAN_WHITE_CASTLE_LEFT);
 		else
 			if (value)
-				flags = (GameFlags)(flags | GameFlags::CAN_BLACK_CASTLE_LEFT);
+				state.flags = (GameFlags)(state.flags | GameFlags::CAN_BLACK_CASTLE_LEFT);
 			else
-				flags = (GameFlags)(flags & ~GameFlags::CAN_BLACK_CASTLE_LEFT);
+				state.flags = (GameFlags)(state.flags & ~GameFlags::CAN_BLACK_CASTLE_LEFT);
 	}
 };
 
-static const auto INVALID_POSITION = (uint8_t)-1;
+static_assert(sizeof(Position) == 3 * 64, "Position should fill exactly three cache lines");
 
-uint8_t pieces_on_board_count(ChessGame* game) {
-	uint8_t result = 0;
+// A position together with how the game got there.
+struct ChessGame : Position
+{
+	bool is_against_ai;
+	MoveHistory history;
+};
+
+static const int16_t piece_values[PIECE_TYPES_COUNT] = {
+	0, // KING, scored by its position.
+	9, // QUEEN
+	5, // ROOK
+	3, // BISHOP
+	3, // KNIGHT
+	1, // PAWN
+};
+
+// The key of the position from scratch, which make_move keeps up to date
+// on its own. Only for setting up positions and for checking make_move.
+uint64_t compute_key(const Position* game) {
+	uint64_t key = zobrist_castling[game->state.flags];
+	for (uint8_t square = 0; square < 8 * 8; ++square)
+		if (game->board[square].type() != PieceType::NONE)
+			key ^= piece_key(game->board[square], square);
+	if (game->state.en_passant_square != INVALID_POSITION)
+		key ^= zobrist_en_passant_col[game->state.en_passant_square % 8];
+	if (game->current_turn == Team::BLACK)
+		key ^= zobrist_black_to_move;
+	return key;
+}
+
+uint64_t compute_pawn_key(const Position* game) {
+	uint64_t key = 0;
+	for (uint8_t square = 0; square < 8 * 8; ++square)
+		if (game->board[square].type() == PieceType::PAWN)
+			key ^= piece_key(game->board[square], square);
+	return key;
+}
+
+uint64_t compute_material_key(const Position* game) {
+	uint64_t key = 0;
+	for (int team = Team::WHITE; team <= Team::BLACK; ++team)
+		for (int type = 0; type < PIECE_TYPES_COUNT; ++type)
+			for (uint8_t i = 0; i < game->piece_counts[team][type]; ++i)
+				key ^= zobrist_pieces[team][type][i];
+	return key;
+}
+
+// Rebuilds the bitboards, piece counts, king squares, material and keys
+// from board, after the board was set directly.
+void sync_board_state(Position* game) {
+	memset(game->pieces_by_type, 0, sizeof(game->pieces_by_type));
+	memset(game->pieces_by_team, 0, sizeof(game->pieces_by_team));
+	memset(game->piece_counts, 0, sizeof(game->piece_counts));
 	for (uint8_t i = 0; i < 8 * 8; ++i)
 		if (game->board[i].type() != PieceType::NONE)
-			++result;
-	return result;
+			game->put_piece(i, game->board[i]);
+	game->state.material = 0;
+	for (int type = 0; type < PIECE_TYPES_COUNT; ++type)
+		game->state.material += piece_values[type] * (game->piece_counts[Team::WHITE][type] - game->piece_counts[Team::BLACK][type]);
+	game->state.key = compute_key(game);
+	game->state.pawn_key = compute_pawn_key(game);
+	game->state.material_key = compute_material_key(game);
+}
+
+uint8_t pieces_on_board_count(Position* game) {
+	return (uint8_t)popcount(game->occupied());
 }
 
 uint8_t NOT_FOUND = (uint8_t)-1;
-uint8_t index_of_king(ChessGame* game, Team team) {
-	for (uint8_t i = 0; i < 8 * 8; ++i)
-		if (game->board[i].type() == PieceType::KING
-			&& game->board[i].team() == team)
-			return i;
-	return NOT_FOUND;
+uint8_t index_of_king(Position* game, Team team) {
+	if (!game->count(PieceType::KING, team))
+		return NOT_FOUND;
+	return game->king_squares[team];
 }
 
-template<typename Callback>
-bool foreach_piece_legal_move(ChessGame* game, uint8_t piece_position, Callback callback, bool full_check = true);
+// All the pieces of both teams attacking square, given the occupied squares.
+Bitboard attackers_to(Position* game, uint8_t square, Bitboard occupied) {
+	return (pawn_attacks[Team::BLACK][square] & game->pieces(PieceType::PAWN, Team::WHITE))
+		| (pawn_attacks[Team::WHITE][square] & game->pieces(PieceType::PAWN, Team::BLACK))
+		| (knight_attacks[square] & game->pieces(PieceType::KNIGHT))
+		| (king_attacks[square] & game->pieces(PieceType::KING))
+		| (rook_attacks(square, occupied) & (game->pieces(PieceType::ROOK) | game->pieces(PieceType::QUEEN)))
+		| (bishop_attacks(square, occupied) & (game->pieces(PieceType::BISHOP) | game->pieces(PieceType::QUEEN)));
+}
 
-template<typename Callback>
-bool foreach_team_legal_move(ChessGame* game, Team team, Callback callback, bool full_check = false);
+// Looks outward from square for a piece of team attacking it, cheapest
+// lookups first, and stops at the first one found.
+bool is_square_attacked(Position* game, uint8_t square, Team team, Bitboard occupied) {
+	Bitboard attackers = game->pieces_by_team[team];
+	if (pawn_attacks[team ^ Team::BLACK][square] & attackers & game->pieces(PieceType::PAWN))
+		return true;
+	if (knight_attacks[square] & attackers & game->pieces(PieceType::KNIGHT))
+		return true;
+	if (king_attacks[square] & attackers & game->pieces(PieceType::KING))
+		return true;
+	Bitboard queens = game->pieces(PieceType::QUEEN);
+	Bitboard rooks = attackers & (game->pieces(PieceType::ROOK) | queens);
+	if (rooks && (rook_attacks(square, occupied) & rooks))
+		return true;
+	Bitboard bishops = attackers & (game->pieces(PieceType::BISHOP) | queens);
+	return bishops && (bishop_attacks(square, occupied) & bishops);
+}
 
-bool check_move_full_legality(ChessGame* game, Move move);
+inline bool is_square_attacked(Position* game, uint8_t square, Team team) {
+	return is_square_attacked(game, square, team, game->occupied());
+}
 
-void performe_move(ChessGame* game, Move move) {
-	game->current_turn = (Team)(game->current_turn ^ Team::BLACK);
-
-	game->history.add(move);
-
-	Piece piece = game->board[move.source];
-	bool is_white = piece.team() == Team::WHITE;
-
-	game->board[move.destination] = piece;
-	game->board[move.source] = Piece(PieceType::NONE);
-
-	if (piece.type() == PieceType::PAWN) {
-		if (move.flags & MoveFlags::EN_PASSANT) {
-			int8_t offset = absolute_value(move.source - move.destination) == 9 ? 1 : -1;
-			if (is_white)
-				offset = -offset;
-			game->board[move.source + offset] = PieceType::NONE;
-		} else if (move.flags & MoveFlags::PROMOTION)
-			game->board[move.destination] = Piece(PieceType::QUEEN | piece.team());
-	} else if (piece.type() == PieceType::KING) {
-		uint8_t source_col = move.source % 8;
-		uint8_t dest_col = move.destination % 8;
-		if (absolute_value(source_col - dest_col) > 1) {
-			uint8_t row = move.destination / 8;
-			if (dest_col == 6) {
-				game->board[row * 8 + 5] = game->board[row * 8 + 7];
-				game->board[row * 8 + 7] = PieceType::NONE;
-			} else {
-				game->board[row * 8 + dest_col + 1] = game->board[row * 8];
-				game->board[row * 8] = PieceType::NONE;
-			}
-		}
-	}
-	if (move.flags & MoveFlags::FIRST_MOVE) {
-		if (piece.type() == PieceType::KING) {
-			game->set_castle_right(false, is_white);
-			game->set_castle_left(false, is_white);
-		} else if (piece.type() == PieceType::ROOK) {
-			uint8_t col = move.source % 8;
-			if (col == 7)
-				game->set_castle_right(false, is_white);
-			else
-				game->set_castle_left(false, is_white);
-		}
-	}
+// Every square team attacks given the occupied squares, sliders through
+// the fill kernels rather than the magic tables.
+Bitboard attack_map(Position* game, Team team, Bitboard occupied) {
+	Bitboard pieces = game->pieces_by_team[team];
+	Bitboard pawns = game->pieces(PieceType::PAWN) & pieces;
+	Bitboard result;
+	// White pawns move toward row 0.
+	if (team == Team::WHITE)
+		result = ((pawns >> 9) & NOT_COL_7) | ((pawns >> 7) & NOT_COL_0);
+	else
+		result = ((pawns << 7) & NOT_COL_7) | ((pawns << 9) & NOT_COL_0);
+	for (Bitboard knights = game->pieces(PieceType::KNIGHT) & pieces; knights;)
+		result |= knight_attacks[pop_lsb(knights)];
+	if (game->count(PieceType::KING, team))
+		result |= king_attacks[game->king_squares[team]];
+	Bitboard queens = game->pieces(PieceType::QUEEN);
+	return result | slider_attack_map((game->pieces(PieceType::ROOK) | queens) & pieces,
+		(game->pieces(PieceType::BISHOP) | queens) & pieces, ~occupied);
 }
 
-void undo_last_move(ChessGame* game) {
-	game->current_turn = (Team)(game->current_turn ^ Team::BLACK);
+// Computed once per position, so that only legal moves are generated
+// without making them.
+struct LegalityInfo
+{
+	uint8_t king;
+	Bitboard checkers;
+	Bitboard pinned;
+	// Where non-king moves must land: everywhere when not in check, the
+	// checker or a square between it and the king in single check,
+	// nowhere in double check.
+	Bitboard check_mask;
+};
+
+void compute_legality_info(Position* game, Team team, LegalityInfo* out) {
+	Team other_team = (Team)(team ^ Team::BLACK);
+	Bitboard occupied = game->occupied();
+	Bitboard enemies = game->pieces_by_team[other_team];
+	uint8_t king = index_of_king(game, team);
+
+	out->king = king;
+	out->checkers = attackers_to(game, king, occupied) & enemies;
+	out->pinned = 0;
+
+	Bitboard snipers = ((rook_attacks(king, 0) & (game->pieces(PieceType::ROOK) | game->pieces(PieceType::QUEEN)))
+		| (bishop_attacks(king, 0) & (game->pieces(PieceType::BISHOP) | game->pieces(PieceType::QUEEN)))) & enemies;
+	while (snipers) {
+		Bitboard blockers = between_bb[king][pop_lsb(snipers)] & occupied;
+		if (popcount(blockers) == 1)
+			out->pinned |= blockers & game->pieces_by_team[team];
+	}
 
-	Move move = game->history.pop();
+	if (!out->checkers)
+		out->check_mask = ~0ULL;
+	else if (popcount(out->checkers) == 1)
+		out->check_mask = out->checkers | between_bb[king][lsb(out->checkers)];
+	else
+		out->check_mask = 0;
+}
 
-	Piece piece = game->board[move.destination];
-	bool is_white = piece.team() == Team::WHITE;
+// En passant removes two pieces from the captured pawn's row, so it is
+// checked by looking at the resulting occupancy.
+inline bool is_en_passant_legal(Position* game, const LegalityInfo* legality, uint8_t source, uint8_t destination, uint8_t captured) {
+	Bitboard occupied = (game->occupied() ^ square_bb(source) ^ square_bb(captured)) | square_bb(destination);
+	Team other_team = game->board[source].other_team();
+	Bitboard enemies = game->pieces_by_team[other_team] & ~square_bb(captured);
+	return !(attackers_to(game, legality->king, occupied) & enemies);
+}
 
-	game->board[move.source] = piece;
-	game->board[move.destination] = Piece(PieceType::NONE);
+// Which moves a generator produces. Promotions count as captures, as both
+// are what quiescence search and capture ordering look at.
+enum class GenType
+{
+	CAPTURES,
+	QUIETS,
+	ALL,
+};
 
-	if (move.flags & MoveFlags::ATTACK)
-		game->board[move.destination] = Piece(move.get_attacked_piece_type() | piece.other_team());
-	if (move.flags & MoveFlags::PROMOTION)
-		game->board[move.source] = Piece(PieceType::PAWN | piece.team());
+template<GenType Type = GenType::ALL, typename Callback>
+bool foreach_piece_legal_move(Position* game, uint8_t piece_position, Callback callback, bool full_check = true);
+
+template<GenType Type = GenType::ALL, typename Callback>
+bool foreach_team_legal_move(Position* game, Team team, Callback callback, bool full_check = false);
+
+// Plays move on the position, saving what it overwrites to out_undo for
+// unmake_move, unless it is null because the move is never taken back.
+// Specialised on the team making the move, so that the team dependent
+// branches fold away.
+template<Team Us>
+void make_move(Position* game, Move move, UndoRecord* out_undo) {
+	constexpr Team Them = Us == Team::WHITE ? Team::BLACK : Team::WHITE;
+	constexpr bool is_white = Us == Team::WHITE;
+	// The square behind a pawn's destination, where en passant captures.
+	constexpr int8_t behind = is_white ? 8 : -8;
+	// Material is kept from white's side.
+	constexpr int sign = is_white ? 1 : -1;
+
+	uint8_t source = move.source();
+	uint8_t destination = move.destination();
+	Piece piece = game->board[source];
+	PieceType type = piece.type();
+
+	Piece captured = game->board[destination];
+	if (out_undo) {
+		out_undo->captured = captured;
+		out_undo->state = game->state;
+	}
 
-	if (piece.type() == PieceType::PAWN) {
-		if (move.flags & MoveFlags::EN_PASSANT) {
-			int8_t offset = absolute_value(move.source - move.destination) == 9 ? 1 : -1;
-			if (is_white)
-				offset = -offset;
-			game->board[move.source + offset] = Piece(PieceType::PAWN | piece.other_team());
-		}
-	} else if (piece.type() == PieceType::KING) {
-		uint8_t source_col = move.source % 8;
-		uint8_t dest_col = move.destination % 8;
-		if (absolute_value(source_col - dest_col) > 1) {
-			uint8_t row = move.source / 8;
-			if (dest_col == 6) {
-				game->board[row * 8 + 7] = Piece(PieceType::ROOK | piece.team());
-				game->board[row * 8 + 5] = PieceType::NONE;
-			} else {
-				game->board[row * 8] = game->board[row * 8 + dest_col + 1];
-				game->board[row * 8 + dest_col + 1] = PieceType::NONE;
-			}
+	uint64_t key = game->state.key ^ zobrist_black_to_move ^ zobrist_castling[game->state.flags];
+	if (game->state.en_passant_square != INVALID_POSITION)
+		key ^= zobrist_en_passant_col[game->state.en_passant_square % 8];
+
+	game->current_turn = Them;
+	game->state.en_passant_square = INVALID_POSITION;
+	++game->state.halfmove_clock;
+
+	if (captured.type() != PieceType::NONE) {
+		game->remove_piece(destination);
+		game->state.halfmove_clock = 0;
+		game->state.material += sign * piece_values[type_index(captured.type())];
+		key ^= piece_key(captured, destination);
+		if (captured.type() == PieceType::PAWN)
+			game->state.pawn_key ^= piece_key(captured, destination);
+		game->state.material_key ^= material_key_term(captured, game->count(captured.type(), Them));
+	}
+	game->move_piece(source, destination);
+	key ^= piece_key(piece, source) ^ piece_key(piece, destination);
+	if (type == PieceType::PAWN)
+		game->state.pawn_key ^= piece_key(piece, source) ^ piece_key(piece, destination);
+
+	switch (move.kind()) {
+	case MoveKind::PROMOTION: {
+		Piece promoted = Piece(move.promotion_type() | Us);
+		game->remove_piece(destination);
+		game->put_piece(destination, promoted);
+		game->state.material += sign * (piece_values[type_index(move.promotion_type())] - piece_values[type_index(PieceType::PAWN)]);
+		key ^= piece_key(piece, destination) ^ piece_key(promoted, destination);
+		game->state.pawn_key ^= piece_key(piece, destination);
+		game->state.material_key ^= material_key_term(piece, game->count(PieceType::PAWN, Us))
+			^ material_key_term(promoted, game->count(move.promotion_type(), Us) - 1);
+	} break;
+	case MoveKind::EN_PASSANT: {
+		Piece captured_pawn = Piece(PieceType::PAWN | Them);
+		game->remove_piece(destination + behind);
+		game->state.material += sign * piece_values[type_index(PieceType::PAWN)];
+		key ^= piece_key(captured_pawn, destination + behind);
+		game->state.pawn_key ^= piece_key(captured_pawn, destination + behind);
+		game->state.material_key ^= material_key_term(captured_pawn, game->count(PieceType::PAWN, Them));
+	} break;
+	case MoveKind::CASTLING: {
+		uint8_t row = destination / 8;
+		uint8_t dest_col = destination % 8;
+		uint8_t rook_source = dest_col == 6 ? row * 8 + 7 : row * 8;
+		uint8_t rook_destination = dest_col == 6 ? row * 8 + 5 : row * 8 + dest_col + 1;
+		game->move_piece(rook_source, rook_destination);
+		Piece rook = Piece(PieceType::ROOK | Us);
+		key ^= piece_key(rook, rook_source) ^ piece_key(rook, rook_destination);
+	} break;
+	default:
+		break;
+	}
+
+	if (type == PieceType::PAWN) {
+		game->state.halfmove_clock = 0;
+		if (absolute_value(source - destination) == 16) {
+			uint8_t skipped = (source + destination) / 2;
+			// Only kept when an enemy pawn is there to take it, so
+			// that generation can trust it without further checks.
+			if (pawn_attacks[Us][skipped] & game->pieces(PieceType::PAWN, Them))
+				game->state.en_passant_square = skipped;
 		}
+	} else if (type == PieceType::KING) {
+		game->set_castle_right(false, is_white);
+		game->set_castle_left(false, is_white);
+	} else if (type == PieceType::ROOK) {
+		uint8_t col = source % 8;
+		if (col == 7)
+			game->set_castle_right(false, is_white);
+		else if (col == 0)
+			game->set_castle_left(false, is_white);
 	}
 
-	if (piece.type() == PieceType::KING || piece.type() == PieceType::ROOK)
-		if (move.flags & MoveFlags::FIRST_MOVE) {
-			if (move.flags & MoveFlags::CASTLE_RIGHT_BEFORE_MOVE)
-				game->set_castle_right(true, is_white);
+	key ^= zobrist_castling[game->state.flags];
+	if (game->state.en_passant_square != INVALID_POSITION)
+		key ^= zobrist_en_passant_col[game->state.en_passant_square % 8];
+	game->state.key = key;
+}
 
-			if (move.flags & MoveFlags::CASTLE_LEFT_BEFORE_MOVE)
-				game->set_castle_left(true, is_white);
-		}
+// Takes back move, the last one made on the position: the pieces are put
+// back and the irreversible state restored from the record. Us is the team
+// that made the move.
+template<Team Us>
+void unmake_move(Position* game, Move move, const UndoRecord* undo) {
+	constexpr Team Them = Us == Team::WHITE ? Team::BLACK : Team::WHITE;
+	constexpr int8_t behind = Us == Team::WHITE ? 8 : -8;
+
+	game->current_turn = Us;
+
+	uint8_t source = move.source();
+	uint8_t destination = move.destination();
+
+	if (move.kind() == MoveKind::PROMOTION) {
+		game->remove_piece(destination);
+		game->put_piece(source, Piece(PieceType::PAWN | Us));
+	} else
+		game->move_piece(destination, source);
+
+	if (undo->captured.type() != PieceType::NONE)
+		game->put_piece(destination, undo->captured);
+
+	if (move.kind() == MoveKind::EN_PASSANT) {
+		game->put_piece(destination + behind, Piece(PieceType::PAWN | Them));
+	} else if (move.kind() == MoveKind::CASTLING) {
+		uint8_t row = source / 8;
+		uint8_t dest_col = destination % 8;
+		if (dest_col == 6)
+			game->move_piece(row * 8 + 5, row * 8 + 7);
+		else
+			game->move_piece(row * 8 + dest_col + 1, row * 8);
+	}
+
+	game->state = undo->state;
+}
+
+inline void make_move(Position* game, Move move, UndoRecord* out_undo) {
+	if (game->current_turn == Team::WHITE)
+		make_move<Team::WHITE>(game, move, out_undo);
+	else
+		make_move<Team::BLACK>(game, move, out_undo);
+}
+
+inline void unmake_move(Position* game, Move move, const UndoRecord* undo) {
+	if (game->current_turn == Team::WHITE)
+		unmake_move<Team::BLACK>(game, move, undo);
+	else
+		unmake_move<Team::WHITE>(game, move, undo);
+}
+
+// Makes the move and records it in the game's history.
+void performe_move(ChessGame* game, Move move) {
+	UndoRecord undo;
+	make_move(game, move, &undo);
+	game->history.add(move, undo);
+}
+
+void undo_last_move(ChessGame* game) {
+	UndoRecord undo;
+	Move move = game->history.pop(&undo);
+	unmake_move(game, move, &undo);
 }
 
 enum IterationStatus
@@ -261,244 +1030,592 @@ enum IterationStatus
 	CONTINUE
 };
 
-bool any_legal_destinations_for_team(ChessGame* game, Team team, int8_t* destinations_to_check, int num_destinations_to_check) {
-	bool result = false;
-	foreach_team_legal_move(game, team,
-		[num_destinations_to_check, destinations_to_check, &result](Move move)
-	{
-		for (int i = 0; i < num_destinations_to_check; ++i) {
-			if (move.destination == destinations_to_check[i]) {
-				result = true;
-				return IterationStatus::BREAK;
-			}
-		}
-		return IterationStatus::CONTINUE;
-	},
-		false);
-	return result;
-}
+#define Call_On_Move(move_to_call)																				\
+	{																																			\
+		if(callback(move_to_call) == IterationStatus::BREAK)									\
+			return true;																											\
+	}																																			\
 
-bool check_move_full_legality(ChessGame* game, Move move) {
-	Team other_team = game->board[move.source].other_team();
-	performe_move(game, move);
-	bool result = true;
-	foreach_team_legal_move(game, other_team,
-		[&result](Move move)
-	{
-		if (move.flags & MoveFlags::ATTACK
-			&& move.get_attacked_piece_type() == PieceType::KING) {
-			result = false;
-			return IterationStatus::BREAK;
-		}
-		return IterationStatus::CONTINUE;
-	},
-		false);
-	undo_last_move(game);
-	return result;
-}
+#define Call_On_Square(destination, kind) Call_On_Move(Move((uint8_t)piece_position, (uint8_t)(destination), kind))
+
+#define Call_On(dest_col, dest_row, kind) Call_On_Square((dest_row) * 8 + (dest_col), kind)
 
-#define Call_On(dest_col, dest_row, flags)															\
+// The queen first, so that callers looking for the first move to a square
+// get the usual promotion.
+#define Call_On_Promotions(destination)																	\
 	{																																			\
-		Move move = Move{ (uint8_t)piece_position, (uint8_t)((dest_row) * 8 + (dest_col)), (MoveFlags)(flags) }; \
-		if((!full_check) || check_move_full_legality(game, move))						\
-			if(callback(move) == IterationStatus::BREAK)											\
-				return true;																										\
+		Call_On_Move(Move((uint8_t)piece_position, (uint8_t)(destination), MoveKind::PROMOTION, PieceType::QUEEN)); \
+		Call_On_Move(Move((uint8_t)piece_position, (uint8_t)(destination), MoveKind::PROMOTION, PieceType::ROOK)); \
+		Call_On_Move(Move((uint8_t)piece_position, (uint8_t)(destination), MoveKind::PROMOTION, PieceType::BISHOP)); \
+		Call_On_Move(Move((uint8_t)piece_position, (uint8_t)(destination), MoveKind::PROMOTION, PieceType::KNIGHT)); \
 	}																																			\
 
-#define Call_On_And_Maybe_Attack(col, row)										\
-	{																														\
-		if(col >= 0 && col < 8 && row >= 0 && row < 8) {					\
-			Piece other = game->piece_at(col, row);									\
-			if(other.type() == PieceType::NONE)	{										\
-				Call_On(col, row, MoveFlags::NO_ACTION);							\
-			}																												\
-			else if(other.team() != piece.team())	{									\
-				Call_On(col, row, MoveFlags::ATTACK | other.type());	\
-			}																												\
-		}																													\
-	}																														\
-
-#define Iterate_Col_And_Row(col_dir, row_dir, flags)										\
-	for(int8_t c = col + (col_dir), r = row + (row_dir); c < 8 && r < 8 && c > -1 && r > -1; c += (col_dir), r += (row_dir)) \
+// Calls on every square of targets, which must not hold pieces of the moving team.
+#define Call_On_Targets(targets)																					\
+	for(Bitboard targets_left = (targets); targets_left;)										\
 	{																																			\
-		Piece other = game->piece_at(c, r);																	\
-		if(other.type() == PieceType::NONE)																	\
-		{																																		\
-			Call_On(c, r, flags);																							\
-		}																																		\
-		else																																\
-		{																																		\
-			if(other.team() != piece.team())																	\
-			{																																	\
-				Call_On(c, r, flags | MoveFlags::ATTACK | other.type());				\
-			}																																	\
-			break;																														\
-		}																																		\
+		uint8_t destination = pop_lsb(targets_left);													\
+		Call_On_Square(destination, MoveKind::NORMAL);												\
+	}																																			
+
+#define Call_On_Promotion_Targets(targets)																\
+	for(Bitboard targets_left = (targets); targets_left;)										\
+	{																																			\
+		uint8_t destination = pop_lsb(targets_left);													\
+		Call_On_Promotions(destination);																		\
 	}																																			
 
 #define Is_Occupied(col, row) (game->board[(row) * 8 + (col)].type() != PieceType::NONE)
 
 
-template<typename Callback>
-bool foreach_piece_legal_move(ChessGame* game, uint8_t piece_position, Callback callback, bool full_check) {
+// Generates the moves of a piece of team Us: only its legal ones when
+// FullCheck, using legality, and its pseudo-legal ones otherwise. Moves not
+// of the given type are never produced. Everything that depends on the
+// team or the mode is folded at compile time.
+template<Team Us, bool FullCheck, GenType Type, typename Callback>
+bool foreach_piece_move(Position* game, uint8_t piece_position, const LegalityInfo* legality, Callback callback) {
+	constexpr Team Them = Us == Team::WHITE ? Team::BLACK : Team::WHITE;
+	constexpr bool is_white = Us == Team::WHITE;
+
 	Piece piece = game->board[piece_position];
-	bool is_white = piece.team() == Team::WHITE;
 	int8_t col = piece_position % 8;
 	int8_t row = piece_position / 8;
+
+	Bitboard target_mask;
+	if (Type == GenType::CAPTURES)
+		target_mask = game->pieces_by_team[Them];
+	else if (Type == GenType::QUIETS)
+		target_mask = ~game->occupied();
+	else
+		target_mask = ~game->pieces_by_team[Us];
+
+	Bitboard legal_mask = ~0ULL;
+	if (FullCheck) {
+		legal_mask = legality->check_mask;
+		if (legality->pinned & square_bb(piece_position))
+			legal_mask &= line_bb[legality->king][piece_position];
+	}
+
 	switch (piece.type()) {
 	case PieceType::PAWN: {
-		int8_t direction = is_white ? -1 : 1;
-		int8_t double_move_row = is_white ? 6 : 1;
-		MoveFlags promotion_flag = (row + direction == 0 || row + direction == 7) ? MoveFlags::PROMOTION : MoveFlags::NO_ACTION;
+		constexpr int8_t direction = is_white ? -1 : 1;
+		constexpr int8_t double_move_row = is_white ? 6 : 1;
+		constexpr int8_t promotion_row = is_white ? 0 : 7;
+		// Where an en passant captured pawn stands, relative to the destination.
+		constexpr int8_t behind = is_white ? 8 : -8;
+		bool is_promotion = row + direction == promotion_row;
 
 		if (!Is_Occupied(col, row + direction)) {
-			Call_On(col, row + direction, promotion_flag);
-			if (row == double_move_row && !Is_Occupied(col, row + direction * 2))
-				Call_On(col, row + direction * 2, MoveFlags::DOUBLE_MOVE);
+			uint8_t destination = (row + direction) * 8 + col;
+			if (is_promotion) {
+				if (Type != GenType::QUIETS && legal_mask & square_bb(destination))
+					Call_On_Promotions(destination);
+			} else if (Type != GenType::CAPTURES) {
+				if (legal_mask & square_bb(destination))
+					Call_On_Square(destination, MoveKind::NORMAL);
+				if (row == double_move_row && !Is_Occupied(col, row + direction * 2) && legal_mask & square_bb((row + direction * 2) * 8 + col))
+					Call_On(col, row + direction * 2, MoveKind::NORMAL);
+			}
 		}
 
-		if (col - 1 >= 0) {
-			Piece left = game->piece_at(col - 1, row + direction);
-			if (left.type() != PieceType::NONE && left.team() != piece.team())
-				Call_On(col - 1, row + direction, promotion_flag | MoveFlags::ATTACK | left.type());
-		}
+		if (Type == GenType::QUIETS)
+			break;
 
-		if (col + 1 <= 7) {
-			Piece right = game->piece_at(col + 1, row + direction);
-			if (right.type() != PieceType::NONE && right.team() != piece.team())
-				Call_On(col + 1, row + direction, promotion_flag | MoveFlags::ATTACK | right.type());
+		Bitboard captures = pawn_attacks[Us][piece_position] & game->pieces_by_team[Them] & legal_mask;
+		if (is_promotion) {
+			Call_On_Promotion_Targets(captures);
+		} else {
+			Call_On_Targets(captures);
 		}
-		if (game->history.cursor > 0) {
-			uint8_t fifth_rank = is_white ? 3 : 4;
-			Move last_move = game->history.peek();
-			uint8_t last_move_row = last_move.destination / 8;
-			uint8_t last_move_col = last_move.destination % 8;
-			if (last_move.flags & MoveFlags::DOUBLE_MOVE && row == fifth_rank
-				&& row == last_move_row && absolute_value(col - last_move_col) == 1) {
-				Call_On(col + (last_move.destination - piece_position), row + direction, MoveFlags::EN_PASSANT);
-			}
+		// The square is only open to the side to move; list asks for either.
+		uint8_t en_passant_square = Us == game->current_turn ? game->state.en_passant_square : INVALID_POSITION;
+		if (en_passant_square != INVALID_POSITION && pawn_attacks[Us][piece_position] & square_bb(en_passant_square)) {
+			if (!FullCheck || is_en_passant_legal(game, legality, piece_position, en_passant_square, en_passant_square + behind))
+				Call_On_Square(en_passant_square, MoveKind::EN_PASSANT);
 		}
 	} break;
 
 	case PieceType::KING: {
-		MoveFlags first_move_flags = MoveFlags::NO_ACTION;
-
-		if (game->can_castle_right(is_white))
-			first_move_flags = (MoveFlags)(first_move_flags | MoveFlags::FIRST_MOVE | MoveFlags::CASTLE_RIGHT_BEFORE_MOVE);
-
-		if (game->can_castle_left(is_white))
-			first_move_flags = (MoveFlags)(first_move_flags | MoveFlags::FIRST_MOVE | MoveFlags::CASTLE_LEFT_BEFORE_MOVE);
-
-		for (int8_t i = row - 1; i <= row + 1; ++i) {
-			if (i < 0 || i > 7)
-				continue;
-			for (int8_t j = col - 1; j <= col + 1; ++j) {
-				if (j < 0 || j > 7)
-					continue;
-				Piece other = game->piece_at(j, i);
-				if (other.type() == PieceType::NONE) {
-					Call_On(j, i, first_move_flags);
-				} else if (other.team() != piece.team()) {
-					Call_On(j, i, first_move_flags | MoveFlags::ATTACK | other.type());
-				}
-			}
+		Bitboard targets = king_attacks[piece_position] & target_mask;
+		// With the king lifted off the board, so that it does not hide the
+		// squares behind it from a slider. Castling can use it as well, as
+		// any slider seeing through the king also attacks the king itself.
+		Bitboard attacked = 0;
+		if (FullCheck) {
+			attacked = attack_map(game, Them, game->occupied() ^ square_bb(piece_position));
+			targets &= ~attacked;
 		}
-		if (full_check) {
+		Call_On_Targets(targets);
+		if (FullCheck && Type != GenType::CAPTURES) {
 			if (game->can_castle_right(is_white)) {
 				Piece maybe_right_rook = game->piece_at(7, row);
-				if (maybe_right_rook.type() == PieceType::ROOK && maybe_right_rook.team() == piece.team() && !Is_Occupied(5, row) && !Is_Occupied(6, row)) {
-					int8_t destinations_to_check[3] = {
-					  row * 8 + 4,
-					  row * 8 + 5,
-					  row * 8 + 6,
-					};
-					if (!any_legal_destinations_for_team(game, piece.other_team(), destinations_to_check, 3)) {
-						Call_On(6, row, first_move_flags);
-					}
+				if (maybe_right_rook.type() == PieceType::ROOK && maybe_right_rook.team() == Us && !Is_Occupied(5, row) && !Is_Occupied(6, row)
+					&& !(attacked & (0x70ULL << (row * 8)))) {
+					Call_On(6, row, MoveKind::CASTLING);
 				}
 			}
 			if (game->can_castle_left(is_white)) {
 				Piece maybe_left_rook = game->piece_at(0, row);
-				if (maybe_left_rook.type() == PieceType::ROOK && maybe_left_rook.team() == piece.team() && !Is_Occupied(3, row) && !Is_Occupied(2, row) && !Is_Occupied(1, row)) {
-					int8_t destinations_to_check[4] = {
-					  row * 8 + 1,
-					  row * 8 + 2,
-					  row * 8 + 3,
-					  row * 8 + 4,
-					};
-					if (!any_legal_destinations_for_team(game, piece.other_team(), destinations_to_check, 4)) {
-						Call_On(2, row, first_move_flags);
-						Call_On(1, row, first_move_flags);
-					}
+				if (maybe_left_rook.type() == PieceType::ROOK && maybe_left_rook.team() == Us && !Is_Occupied(3, row) && !Is_Occupied(2, row) && !Is_Occupied(1, row)
+					&& !(attacked & (0x1EULL << (row * 8)))) {
+					Call_On(2, row, MoveKind::CASTLING);
+					Call_On(1, row, MoveKind::CASTLING);
 				}
 			}
 		}
 	} break;
 	case PieceType::QUEEN: {
-		Iterate_Col_And_Row(-1, -1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(1, 1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(1, -1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(-1, 1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(0, -1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(0, 1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(1, 0, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(-1, 0, MoveFlags::NO_ACTION);
+		Call_On_Targets(queen_attacks(piece_position, game->occupied()) & target_mask & legal_mask);
 	} break;
 
 	case PieceType::BISHOP: {
-		Iterate_Col_And_Row(-1, -1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(1, 1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(1, -1, MoveFlags::NO_ACTION);
-		Iterate_Col_And_Row(-1, 1, MoveFlags::NO_ACTION);
+		Call_On_Targets(bishop_attacks(piece_position, game->occupied()) & target_mask & legal_mask);
 	} break;
 
 	case PieceType::KNIGHT: {
-		Call_On_And_Maybe_Attack(col + 1, row + 2);
-		Call_On_And_Maybe_Attack(col + 1, row - 2);
-		Call_On_And_Maybe_Attack(col - 1, row + 2);
-		Call_On_And_Maybe_Attack(col - 1, row - 2);
-		Call_On_And_Maybe_Attack(col + 2, row + 1);
-		Call_On_And_Maybe_Attack(col + 2, row - 1);
-		Call_On_And_Maybe_Attack(col - 2, row + 1);
-		Call_On_And_Maybe_Attack(col - 2, row - 1);
+		Call_On_Targets(knight_attacks[piece_position] & target_mask & legal_mask);
 	} break;
 
 	case PieceType::ROOK: {
-		MoveFlags first_move_flag = MoveFlags::NO_ACTION;
-
-		if (game->can_castle_right(is_white) && col == 7)
-			first_move_flag = MoveFlags::FIRST_MOVE;
-		if (game->can_castle_left(is_white) && col == 0)
-			first_move_flag = MoveFlags::FIRST_MOVE;
-
-		if (first_move_flag & MoveFlags::FIRST_MOVE) {
-			if (game->can_castle_right(is_white))
-				first_move_flag = (MoveFlags)(first_move_flag | MoveFlags::CASTLE_RIGHT_BEFORE_MOVE);
-			if (game->can_castle_left(is_white))
-				first_move_flag = (MoveFlags)(first_move_flag | MoveFlags::CASTLE_LEFT_BEFORE_MOVE);
-		}
-
-		Iterate_Col_And_Row(0, -1, first_move_flag);
-		Iterate_Col_And_Row(0, 1, first_move_flag);
-		Iterate_Col_And_Row(1, 0, first_move_flag);
-		Iterate_Col_And_Row(-1, 0, first_move_flag);
+		Call_On_Targets(rook_attacks(piece_position, game->occupied()) & target_mask & legal_mask);
 	} break;
 	}
 	return false;
 }
 
-template<typename Callback>
-bool foreach_team_legal_move(ChessGame* game, Team team, Callback callback, bool full_check) {
-	for (int i = 0; i < 8 * 8; ++i) {
-		Piece piece = game->board[i];
-		if (piece.type() != PieceType::NONE && piece.team() == team) {
-			if (foreach_piece_legal_move(game, i, callback, full_check))
-				return true;
-		}
+// In check, only the king and the pieces able to capture the checker or to
+// step between it and the king have legal moves, so only those pieces are
+// looked at. In double check only the king can move.
+template<Team Us, GenType Type, typename Callback>
+bool foreach_evasion_move(Position* game, const LegalityInfo* legality, Callback callback) {
+	if (foreach_piece_move<Us, true, Type>(game, legality->king, legality, callback))
+		return true;
+	if (popcount(legality->checkers) > 1)
+		return false;
+
+	Bitboard occupied = game->occupied();
+	uint8_t checker = lsb(legality->checkers);
+	Bitboard blocks = between_bb[legality->king][checker];
+
+	Bitboard candidates = attackers_to(game, checker, occupied);
+	for (Bitboard bb = blocks; bb;)
+		candidates |= attackers_to(game, pop_lsb(bb), occupied);
+
+	// Pawns step to the blocking squares without attacking them.
+	Bitboard pawns = game->pieces(PieceType::PAWN, Us);
+	Bitboard single_push_sources = Us == Team::WHITE ? blocks << 8 : blocks >> 8;
+	Bitboard double_push_sources = Us == Team::WHITE ? (single_push_sources & ~occupied) << 8 : (single_push_sources & ~occupied) >> 8;
+	candidates |= (single_push_sources | double_push_sources) & pawns;
+	if (game->state.en_passant_square != INVALID_POSITION)
+		candidates |= pawn_attacks[Us ^ Team::BLACK][game->state.en_passant_square] & pawns;
+
+	// Pinned pieces can never resolve a check.
+	candidates &= game->pieces_by_team[Us] & ~legality->pinned & ~square_bb(legality->king);
+	while (candidates) {
+		if (foreach_piece_move<Us, true, Type>(game, pop_lsb(candidates), legality, callback))
+			return true;
 	}
 	return false;
 }
 
+template<Team Us, bool FullCheck, GenType Type, typename Callback>
+bool foreach_team_move(Position* game, Callback callback) {
+	LegalityInfo legality;
+	if (FullCheck) {
+		compute_legality_info(game, Us, &legality);
+		if (legality.checkers)
+			return foreach_evasion_move<Us, Type>(game, &legality, callback);
+	}
+	Bitboard team_pieces = game->pieces_by_team[Us];
+	while (team_pieces) {
+		if (foreach_piece_move<Us, FullCheck, Type>(game, pop_lsb(team_pieces), &legality, callback))
+			return true;
+	}
+	return false;
+}
+
+template<Team Us, bool FullCheck, GenType Type, typename Callback>
+bool foreach_single_piece_move(Position* game, uint8_t piece_position, Callback callback) {
+	LegalityInfo legality;
+	if (FullCheck)
+		compute_legality_info(game, Us, &legality);
+	return foreach_piece_move<Us, FullCheck, Type>(game, piece_position, &legality, callback);
+}
+
+// The entry points below pick the specialisation for the runtime team and
+// mode once per call.
+
+template<GenType Type, typename Callback>
+bool foreach_piece_legal_move(Position* game, uint8_t piece_position, Callback callback, bool full_check) {
+	if (game->board[piece_position].team() == Team::WHITE)
+		return full_check
+			? foreach_single_piece_move<Team::WHITE, true, Type>(game, piece_position, callback)
+			: foreach_single_piece_move<Team::WHITE, false, Type>(game, piece_position, callback);
+	return full_check
+		? foreach_single_piece_move<Team::BLACK, true, Type>(game, piece_position, callback)
+		: foreach_single_piece_move<Team::BLACK, false, Type>(game, piece_position, callback);
+}
+
+template<GenType Type, typename Callback>
+bool foreach_team_legal_move(Position* game, Team team, Callback callback, bool full_check) {
+	if (team == Team::WHITE)
+		return full_check
+			? foreach_team_move<Team::WHITE, true, Type>(game, callback)
+			: foreach_team_move<Team::WHITE, false, Type>(game, callback);
+	return full_check
+		? foreach_team_move<Team::BLACK, true, Type>(game, callback)
+		: foreach_team_move<Team::BLACK, false, Type>(game, callback);
+}
+
+// Legal positions have at most 218 moves, see load_fen's material check.
+static constexpr auto MAX_MOVES = 256;
+
+struct ScoredMove
+{
+	Move move;
+	int score;
+};
+
+// Fixed-capacity, stack-allocatable list of moves, each with a slot for
+// ordering scores.
+struct MoveList
+{
+	ScoredMove moves[MAX_MOVES];
+	int size = 0;
+	inline void add(Move move) {
+		assert(size < MAX_MOVES);
+		moves[size++] = ScoredMove{ move, 0 };
+	}
+	inline ScoredMove& operator[](int index) { return moves[index]; }
+	inline ScoredMove* begin() { return moves; }
+	inline ScoredMove* end() { return moves + size; }
+};
+
+// Appends the legal moves of the given type, of the team to play, to the list.
+template<GenType Type = GenType::ALL>
+void generate_moves(Position* game, MoveList& list) {
+	foreach_team_legal_move<Type>(game, game->current_turn,
+		[&list](Move move)
+	{
+		list.add(move);
+		return IterationStatus::CONTINUE;
+	}, true);
+}
+
+// The number of legal moves of team Us, from the same masks the generator
+// uses but without producing a single move. Pawns that are not pinned are
+// counted all at once by shifting the whole set, promotions four times.
+// With StopAtFirst it returns as soon as the count is not zero, trying the
+// cheapest pieces first. out_in_check, when given, is set to whether Us is
+// in check.
+template<Team Us, bool StopAtFirst = false>
+int count_team_legal_moves(Position* game, bool* out_in_check = nullptr) {
+	constexpr Team Them = Us == Team::WHITE ? Team::BLACK : Team::WHITE;
+	constexpr bool is_white = Us == Team::WHITE;
+	constexpr int8_t forward = is_white ? -8 : 8;
+	constexpr Bitboard promotion_row = is_white ? 0xFFULL : 0xFFULL << 56;
+	// Where the pawns that may still make a double move land after one step.
+	constexpr Bitboard double_move_row = is_white ? 0xFFULL << 40 : 0xFFULL << 16;
+
+	LegalityInfo legality;
+	compute_legality_info(game, Us, &legality);
+	if (out_in_check)
+		*out_in_check = legality.checkers != 0;
+	uint8_t king = legality.king;
+	uint8_t row = king / 8;
+	Bitboard own = game->pieces_by_team[Us];
+	Bitboard enemies = game->pieces_by_team[Them];
+	Bitboard occupied = own | enemies;
+
+	Bitboard attacked = attack_map(game, Them, occupied ^ square_bb(king));
+	int count = popcount(king_attacks[king] & ~own & ~attacked);
+	if (popcount(legality.checkers) > 1 || (StopAtFirst && count))
+		return count;
+	// Castling is only legal when the king could step aside as well, so it
+	// never adds the first move.
+	if (!StopAtFirst && !legality.checkers) {
+		if (game->can_castle_right(is_white) && game->board[row * 8 + 7].info == (PieceType::ROOK | Us)
+			&& !(occupied & (0x60ULL << (row * 8))) && !(attacked & (0x70ULL << (row * 8))))
+			count += 1;
+		// Both the king's destinations of the generator.
+		if (game->can_castle_left(is_white) && game->board[row * 8].info == (PieceType::ROOK | Us)
+			&& !(occupied & (0x0EULL << (row * 8))) && !(attacked & (0x1EULL << (row * 8))))
+			count += 2;
+	}
+
+	Bitboard check_mask = legality.check_mask;
+	Bitboard pinned = legality.pinned;
+	Bitboard targets = ~own & check_mask;
+
+	Bitboard pawns = game->pieces(PieceType::PAWN, Us);
+	Bitboard free_pawns = pawns & ~pinned;
+	Bitboard pushes = (is_white ? free_pawns >> 8 : free_pawns << 8) & ~occupied;
+	Bitboard double_pushes = (is_white ? (pushes & double_move_row) >> 8 : (pushes & double_move_row) << 8) & ~occupied;
+	pushes &= check_mask;
+	double_pushes &= check_mask;
+	// Apart, as a square can be taken from both sides.
+	Bitboard left_captures = (is_white ? free_pawns >> 9 : free_pawns << 7) & NOT_COL_7 & enemies & check_mask;
+	Bitboard right_captures = (is_white ? free_pawns >> 7 : free_pawns << 9) & NOT_COL_0 & enemies & check_mask;
+	count += popcount(pushes & ~promotion_row) + 4 * popcount(pushes & promotion_row) + popcount(double_pushes);
+	count += popcount(left_captures & ~promotion_row) + 4 * popcount(left_captures & promotion_row);
+	count += popcount(right_captures & ~promotion_row) + 4 * popcount(right_captures & promotion_row);
+	if (StopAtFirst && count)
+		return count;
+
+	// Pinned knights can never move.
+	for (Bitboard bb = game->pieces(PieceType::KNIGHT, Us) & ~pinned; bb;)
+		count += popcount(knight_attacks[pop_lsb(bb)] & targets);
+	if (StopAtFirst && count)
+		return count;
+
+	// Queens are counted by both loops, once for each half of their moves.
+	Bitboard queens = game->pieces(PieceType::QUEEN, Us);
+	for (Bitboard bb = game->pieces(PieceType::BISHOP, Us) | queens; bb;) {
+		uint8_t square = pop_lsb(bb);
+		Bitboard mask = pinned & square_bb(square) ? targets & line_bb[king][square] : targets;
+		count += popcount(bishop_attacks(square, occupied) & mask);
+		if (StopAtFirst && count)
+			return count;
+	}
+	for (Bitboard bb = game->pieces(PieceType::ROOK, Us) | queens; bb;) {
+		uint8_t square = pop_lsb(bb);
+		Bitboard mask = pinned & square_bb(square) ? targets & line_bb[king][square] : targets;
+		count += popcount(rook_attacks(square, occupied) & mask);
+		if (StopAtFirst && count)
+			return count;
+	}
+
+	for (Bitboard bb = pawns & pinned; bb;) {
+		uint8_t square = pop_lsb(bb);
+		Bitboard mask = check_mask & line_bb[king][square];
+		Bitboard pawn_targets = pawn_attacks[Us][square] & enemies;
+		uint8_t push = square + forward;
+		if (!(occupied & square_bb(push))) {
+			pawn_targets |= square_bb(push);
+			if (double_move_row & square_bb(push) && !(occupied & square_bb(push + forward)))
+				pawn_targets |= square_bb(push + forward);
+		}
+		pawn_targets &= mask;
+		count += popcount(pawn_targets & ~promotion_row) + 4 * popcount(pawn_targets & promotion_row);
+	}
+	if (StopAtFirst && count)
+		return count;
+
+	uint8_t en_passant_square = game->state.en_passant_square;
+	if (en_passant_square != INVALID_POSITION) {
+		// Like the evasion generator, pinned pawns are left out when in check.
+		Bitboard takers = pawn_attacks[Them][en_passant_square] & pawns;
+		if (legality.checkers)
+			takers &= ~pinned;
+		while (takers) {
+			uint8_t square = pop_lsb(takers);
+			if (is_en_passant_legal(game, &legality, square, en_passant_square, en_passant_square - forward))
+				++count;
+		}
+	}
+	return count;
+}
+
+// The number of legal moves of the team to play.
+inline int count_legal_moves(Position* game) {
+	if (game->current_turn == Team::WHITE)
+		return count_team_legal_moves<Team::WHITE>(game);
+	return count_team_legal_moves<Team::BLACK>(game);
+}
+
+// Whether the team to play has a legal move, and whether it is in check.
+inline bool has_any_legal_move(Position* game, bool* out_in_check) {
+	if (game->current_turn == Team::WHITE)
+		return count_team_legal_moves<Team::WHITE, true>(game, out_in_check) != 0;
+	return count_team_legal_moves<Team::BLACK, true>(game, out_in_check) != 0;
+}
+
+// The number of leaves of the legal move tree depth plies deep. With
+// CountLastPly the moves of the last ply are counted instead of played.
+template<bool CountLastPly = true>
+uint64_t perft(Position* game, int depth) {
+	if (depth <= 0)
+		return 1;
+	if (CountLastPly && depth == 1)
+		return count_legal_moves(game);
+	MoveList moves;
+	generate_moves(game, moves);
+	uint64_t nodes = 0;
+	for (ScoredMove& scored : moves) {
+		UndoRecord undo;
+		make_move(game, scored.move, &undo);
+		nodes += perft<CountLastPly>(game, depth - 1);
+		unmake_move(game, scored.move, &undo);
+	}
+	return nodes;
+}
+
+// Subtree counts of perft_hashed, by position key and depth. Threads share
+// the table without locks: each field is atomic on its own, and an entry
+// stores its key xored with its data, so that an entry torn by two
+// concurrent writers no longer matches any key and is simply missed.
+struct PerftEntry
+{
+	std::atomic<uint64_t> checked_key;
+	// The count above the low 8 bits, the depth in them.
+	std::atomic<uint64_t> data;
+};
+
+struct PerftTable
+{
+	std::vector<PerftEntry> entries;
+	uint64_t mask = 0;
+};
+
+static PerftTable perft_table;
+
+// Sizes the table to the largest power of two entries fitting megabytes,
+// no table at all for 0, and clears it. When the memory cannot be had the
+// table is left as it was and false is returned.
+bool resize_perft_table(int megabytes) {
+	uint64_t count = 0;
+	if (megabytes > 0) {
+		count = 1;
+		while (count * 2 * sizeof(PerftEntry) <= (uint64_t)megabytes << 20)
+			count *= 2;
+	}
+	try {
+		std::vector<PerftEntry>(count).swap(perft_table.entries);
+	} catch (const std::bad_alloc&) {
+		return false;
+	}
+	perft_table.mask = count ? count - 1 : 0;
+	return true;
+}
+
+inline void clear_perft_table() {
+	for (PerftEntry& entry : perft_table.entries) {
+		entry.checked_key.store(0, std::memory_order_relaxed);
+		entry.data.store(0, std::memory_order_relaxed);
+	}
+}
+
+// perft, with the count of every subtree at least two plies deep looked up
+// in perft_table first, so that transpositions are only counted once.
+// Plain perft when there is no table.
+uint64_t perft_hashed(Position* game, int depth) {
+	if (perft_table.entries.empty() || depth <= 1)
+		return perft(game, depth);
+
+	uint64_t key = game->state.key;
+	PerftEntry* entry = &perft_table.entries[key & perft_table.mask];
+	uint64_t data = entry->data.load(std::memory_order_relaxed);
+	if ((entry->checked_key.load(std::memory_order_relaxed) ^ data) == key && (int)(data & 0xFF) == depth)
+		return data >> 8;
+
+	MoveList moves;
+	generate_moves(game, moves);
+	uint64_t nodes = 0;
+	for (ScoredMove& scored : moves) {
+		UndoRecord undo;
+		make_move(game, scored.move, &undo);
+		nodes += perft_hashed(game, depth - 1);
+		unmake_move(game, scored.move, &undo);
+	}
+
+	data = nodes << 8 | (uint64_t)depth;
+	entry->checked_key.store(key ^ data, std::memory_order_relaxed);
+	entry->data.store(data, std::memory_order_relaxed);
+	return nodes;
+}
+
+// Deeper splits only add work items: three plies give tens of thousands
+// in typical positions, plenty to keep any thread pool busy.
+static constexpr auto MAX_PERFT_SPLIT_DEPTH = 3;
+
+struct PerftSettings
+{
+	int threads = 1;
+	// Plies below the root at which the work is shared out between threads,
+	// up to MAX_PERFT_SPLIT_DEPTH.
+	int split_depth = 2;
+};
+
+static PerftSettings perft_settings;
+
+// The moves leading from the root to a position split_depth plies deep,
+// with the index of the root move it is under and, once a worker is done
+// with it, the leaves under it.
+struct PerftSplit
+{
+	Move moves[MAX_PERFT_SPLIT_DEPTH];
+	int root_move;
+	uint64_t nodes;
+};
+
+void collect_perft_splits(Position* game, int split_depth, int ply, PerftSplit* split, std::vector<PerftSplit>* out) {
+	if (ply == split_depth) {
+		out->push_back(*split);
+		return;
+	}
+	MoveList moves;
+	generate_moves(game, moves);
+	for (ScoredMove& scored : moves) {
+		split->moves[ply] = scored.move;
+		UndoRecord undo;
+		make_move(game, scored.move, &undo);
+		collect_perft_splits(game, split_depth, ply + 1, split, out);
+		unmake_move(game, scored.move, &undo);
+	}
+}
+
+// Counts the leaves depth plies under each of moves, the legal moves of game
+// in generation order, into out_nodes. With more than one thread the move
+// sequences perft_settings.split_depth plies deep are handed out to a pool
+// of perft_settings.threads workers, each playing them on its own copy of
+// game.
+void perft_root_moves(Position* game, int depth, MoveList& moves, uint64_t* out_nodes) {
+	int split_depth = std::min(std::min(std::max(perft_settings.split_depth, 1), MAX_PERFT_SPLIT_DEPTH), depth - 1);
+	if (perft_settings.threads <= 1 || split_depth < 1) {
+		for (int i = 0; i < moves.size; ++i) {
+			UndoRecord undo;
+			make_move(game, moves[i].move, &undo);
+			out_nodes[i] = perft_hashed(game, depth - 1);
+			unmake_move(game, moves[i].move, &undo);
+		}
+		return;
+	}
+
+	std::vector<PerftSplit> splits;
+	for (int i = 0; i < moves.size; ++i) {
+		PerftSplit split{};
+		split.moves[0] = moves[i].move;
+		split.root_move = i;
+		UndoRecord undo;
+		make_move(game, moves[i].move, &undo);
+		collect_perft_splits(game, split_depth, 1, &split, &splits);
+		unmake_move(game, moves[i].move, &undo);
+	}
+
+	std::atomic<size_t> next_split(0);
+	auto worker = [game, &splits, &next_split, depth, split_depth]() {
+		Position position = *game;
+		UndoRecord undo[MAX_PERFT_SPLIT_DEPTH];
+		for (size_t i = next_split++; i < splits.size(); i = next_split++) {
+			PerftSplit& split = splits[i];
+			for (int ply = 0; ply < split_depth; ++ply)
+				make_move(&position, split.moves[ply], &undo[ply]);
+			split.nodes = perft_hashed(&position, depth - split_depth);
+			for (int ply = split_depth - 1; ply >= 0; --ply)
+				unmake_move(&position, split.moves[ply], &undo[ply]);
+		}
+	};
+	std::vector<std::thread> workers;
+	for (int i = 0; i < perft_settings.threads; ++i)
+		workers.emplace_back(worker);
+	for (std::thread& thread : workers)
+		thread.join();
+
+	std::fill(out_nodes, out_nodes + moves.size, 0);
+	for (PerftSplit& split : splits)
+		out_nodes[split.root_move] += split.nodes;
+}
+
 void init_game(ChessGame* out_game) {
 	while (true) {
 		printf("Do you want to play against AI? (y | n): ");
@@ -511,10 +1628,12 @@ void init_game(ChessGame* out_game) {
 		}
 	}
 
-	out_game->flags = (GameFlags)
+	out_game->state.flags = (GameFlags)
 		(GameFlags::CAN_WHITE_CASTLE_RIGHT | GameFlags::CAN_WHITE_CASTLE_LEFT |
 			GameFlags::CAN_BLACK_CASTLE_RIGHT | GameFlags::CAN_BLACK_CASTLE_LEFT);
 	out_game->current_turn = Team::WHITE;
+	out_game->state.en_passant_square = INVALID_POSITION;
+	out_game->state.halfmove_clock = 0;
 
 	memset(out_game->board, (uint8_t)PieceType::NONE, 8 * 8);
 
@@ -551,16 +1670,153 @@ void init_game(ChessGame* out_game) {
 	out_game->board[53] = (PieceType::PAWN | Team::WHITE);
 	out_game->board[54] = (PieceType::PAWN | Team::WHITE);
 	out_game->board[55] = (PieceType::PAWN | Team::WHITE);
+
+	sync_board_state(out_game);
+}
+
+// Sets up out from the placement, side to move, castling, en passant and
+// halfmove clock fields of a FEN string; the fullmove number is ignored.
+// out is left untouched when fen is not a valid position.
+bool load_fen(Position* out, const char* fen) {
+	Position position{};
+	memset(position.board, (uint8_t)PieceType::NONE, 8 * 8);
+
+	const char* it = fen;
+	while (*it == ' ')
+		++it;
+	// Every rank has to add up to eight squares before its '/'.
+	int rank = 0;
+	int file = 0;
+	for (; *it != '\0' && *it != ' '; ++it) {
+		char c = *it;
+		if (c == '/') {
+			if (file != 8 || rank == 7)
+				return false;
+			++rank;
+			file = 0;
+			continue;
+		}
+		if (c >= '1' && c <= '8') {
+			file += c - '0';
+			if (file > 8)
+				return false;
+			continue;
+		}
+		Team team = c >= 'a' ? Team::BLACK : Team::WHITE;
+		PieceType type;
+		switch (c | 0x20) {
+		case 'k': type = PieceType::KING; break;
+		case 'q': type = PieceType::QUEEN; break;
+		case 'r': type = PieceType::ROOK; break;
+		case 'b': type = PieceType::BISHOP; break;
+		case 'n': type = PieceType::KNIGHT; break;
+		case 'p': type = PieceType::PAWN; break;
+		default: return false;
+		}
+		if (file >= 8)
+			return false;
+		position.board[rank * 8 + file++] = Piece(type | team);
+	}
+	if (rank != 7 || file != 8)
+		return false;
+	sync_board_state(&position);
+	if (position.count(PieceType::KING, Team::WHITE) != 1 || position.count(PieceType::KING, Team::BLACK) != 1)
+		return false;
+	// The generator steps pawns off the board from the first and last rows.
+	if (position.pieces(PieceType::PAWN) & 0xFF000000000000FFULL)
+		return false;
+	// Material no game can reach could have more moves than a MoveList holds.
+	for (int team = Team::WHITE; team <= Team::BLACK; ++team) {
+		int pawns = position.count(PieceType::PAWN, (Team)team);
+		int promoted = std::max(position.count(PieceType::QUEEN, (Team)team) - 1, 0)
+			+ std::max(position.count(PieceType::ROOK, (Team)team) - 2, 0)
+			+ std::max(position.count(PieceType::BISHOP, (Team)team) - 2, 0)
+			+ std::max(position.count(PieceType::KNIGHT, (Team)team) - 2, 0);
+		if (popcount(position.pieces_by_team[team]) > 16 || pawns > 8 || promoted > 8 - pawns)
+			return false;
+	}
+
+	while (*it == ' ')
+		++it;
+	if (*it == 'w')
+		position.current_turn = Team::WHITE;
+	else if (*it == 'b')
+		position.current_turn = Team::BLACK;
+	else
+		return false;
+	++it;
+	// The side that just moved cannot have left its king in check.
+	Team them = position.current_turn == Team::WHITE ? Team::BLACK : Team::WHITE;
+	if (is_square_attacked(&position, position.king_squares[them], position.current_turn))
+		return false;
+
+	while (*it == ' ')
+		++it;
+	int flags = 0;
+	for (; *it != '\0' && *it != ' '; ++it) {
+		switch (*it) {
+		case 'K': flags |= GameFlags::CAN_WHITE_CASTLE_RIGHT; break;
+		case 'Q': flags |= GameFlags::CAN_WHITE_CASTLE_LEFT; break;
+		case 'k': flags |= GameFlags::CAN_BLACK_CASTLE_RIGHT; break;
+		case 'q': flags |= GameFlags::CAN_BLACK_CASTLE_LEFT; break;
+		case '-': break;
+		default: return false;
+		}
+	}
+	// Rights whose king or rook is not at home are dropped.
+	for (int team = Team::WHITE; team <= Team::BLACK; ++team) {
+		uint8_t row = team == Team::WHITE ? 7 : 0;
+		uint8_t rook = PieceType::ROOK | team;
+		if (position.board[row * 8 + 4].info != (PieceType::KING | team))
+			flags &= team == Team::WHITE ? ~(CAN_WHITE_CASTLE_RIGHT | CAN_WHITE_CASTLE_LEFT) : ~(CAN_BLACK_CASTLE_RIGHT | CAN_BLACK_CASTLE_LEFT);
+		if (position.board[row * 8 + 7].info != rook)
+			flags &= team == Team::WHITE ? ~CAN_WHITE_CASTLE_RIGHT : ~CAN_BLACK_CASTLE_RIGHT;
+		if (position.board[row * 8].info != rook)
+			flags &= team == Team::WHITE ? ~CAN_WHITE_CASTLE_LEFT : ~CAN_BLACK_CASTLE_LEFT;
+	}
+	position.state.flags = (GameFlags)flags;
+
+	while (*it == ' ')
+		++it;
+	position.state.en_passant_square = INVALID_POSITION;
+	if (*it >= 'a' && *it <= 'h' && it[1] >= '1' && it[1] <= '8') {
+		uint8_t row = 8 - (it[1] - '0');
+		uint8_t skipped = row * 8 + (*it - 'a');
+		uint8_t pushed = them == Team::WHITE ? skipped - 8 : skipped + 8;
+		uint8_t origin = them == Team::WHITE ? skipped + 8 : skipped - 8;
+		if (row != (them == Team::WHITE ? 5 : 2))
+			return false;
+		// The pawn must have come from its origin, over the skipped square.
+		if (position.board[skipped].type() != PieceType::NONE || position.board[origin].type() != PieceType::NONE)
+			return false;
+		// Same rule as make_move: only kept when it can be taken.
+		if (position.board[pushed].info == (PieceType::PAWN | them)
+			&& (pawn_attacks[them][skipped] & position.pieces(PieceType::PAWN, position.current_turn)))
+			position.state.en_passant_square = skipped;
+		it += 2;
+	} else if (*it == '-')
+		++it;
+	else if (*it != '\0')
+		return false;
+
+	int halfmove_clock = atoi(it);
+	position.state.halfmove_clock = (uint8_t)(halfmove_clock < 0 ? 0 : halfmove_clock > 100 ? 100 : halfmove_clock);
+	position.state.key = compute_key(&position);
+	position.state.pawn_key = compute_pawn_key(&position);
+	position.state.material_key = compute_material_key(&position);
+
+	*out = position;
+	return true;
 }
 
 void print_board(ChessGame* game) {
-	bool has_moved = game->history.cursor > 0;
+	bool has_moved = game->history.size() > 0;
 	uint8_t last_src;
 	uint8_t last_dst;
 	if (has_moved) {
 		Move last_move = game->history.peek();
-		last_src = last_move.source;
-		last_dst = last_move.destination;
+		last_src = last_move.source();
+		last_dst = last_move.destination();
 	}
 
 	printf("    1 2 3 4 5 6 7 8\n");
@@ -632,6 +1888,8 @@ bool parse_move(char* str, Move* out) {
 	};
 
 	Parse_State parse_state = SRC_ROW;
+	uint8_t source = 0;
+	uint8_t destination = 0;
 	auto should_skip = [](char c) { return c == ' '; };
 	auto is_legal_row = [](char c) { return c >= 'a' && c <= 'h'; };
 	auto is_legal_col = [](char c) { return c >= '1' && c <= '8'; };
@@ -644,44 +1902,47 @@ bool parse_move(char* str, Move* out) {
 		case SRC_ROW: {
 			if (!is_legal_row(*it))
 				return false;
-			out->source = (*it - 'a') * 8;
+			source = (*it - 'a') * 8;
 			parse_state = SRC_COL;
 		} break;
 
 		case SRC_COL: {
 			if (!is_legal_col(*it))
 				return false;
-			out->source += (*it - '1');
+			source += (*it - '1');
 			parse_state = DST_ROW;
 		} break;
 
 		case DST_ROW: {
 			if (!is_legal_row(*it))
 				return false;
-			out->destination = (*it - 'a') * 8;
+			destination = (*it - 'a') * 8;
 			parse_state = DST_COL;
 		} break;
 
 		case DST_COL: {
 			if (!is_legal_col(*it))
 				return false;
-			out->destination += (*it - '1');
+			destination += (*it - '1');
 			parse_state = DONE;
 		} break;
 		}
 	}
-	return parse_state == DONE;
+	if (parse_state != DONE)
+		return false;
+	*out = Move(source, destination);
+	return true;
 }
 
 bool check_move_legality_and_get_flags(ChessGame* game, Move* out_move) {
 	bool is_legal = false;
-	if (game->current_turn != game->board[out_move->source].team())
+	if (game->current_turn != game->board[out_move->source()].team())
 		return false;
-	foreach_piece_legal_move(game, out_move->source, [&is_legal, out_move](Move move)
+	foreach_piece_legal_move(game, out_move->source(), [&is_legal, out_move](Move move)
 	{
-		if (move.destination == out_move->destination) {
+		if (move.destination() == out_move->destination()) {
 			is_legal = true;
-			out_move->flags = move.flags;
+			*out_move = move;
 			return IterationStatus::BREAK;
 		}
 		return IterationStatus::CONTINUE;
@@ -690,6 +1951,23 @@ bool check_move_legality_and_get_flags(ChessGame* game, Move* out_move) {
 	return is_legal;
 }
 
+// Whether move, flags included, is legal for the team to play. Cheaper than
+// generating all the moves, as only the moving piece is looked at.
+bool is_legal_move(Position* game, Move move) {
+	Piece piece = game->board[move.source()];
+	if (piece.type() == PieceType::NONE || piece.team() != game->current_turn)
+		return false;
+	bool is_legal = false;
+	foreach_piece_legal_move(game, move.source(), [&is_legal, move](Move legal_move)
+	{
+		if (legal_move == move) {
+			is_legal = true;
+			return IterationStatus::BREAK;
+		}
+		return IterationStatus::CONTINUE;
+	});
+	return is_legal;
+}
 
 enum class GameStatus
 {
@@ -698,84 +1976,44 @@ enum class GameStatus
 	CONTINUE,
 };
 
-GameStatus get_game_status(ChessGame* game) {
-	bool has_moves = false;
-	foreach_team_legal_move(game, game->current_turn,
-		[&has_moves](Move)
-	{
-		has_moves = true;
-		return IterationStatus::BREAK;
-	}, true);
-	if (has_moves)
+GameStatus get_game_status(Position* game) {
+	bool is_check;
+	if (has_any_legal_move(game, &is_check))
 		return GameStatus::CONTINUE;
-
-	bool is_check = false;
-	Team other_team = game->current_turn == Team::WHITE ? Team::BLACK : Team::WHITE;
-	foreach_team_legal_move(game, other_team,
-		[&is_check](Move move)
-	{
-		if (move.flags & MoveFlags::ATTACK
-			&& move.get_attacked_piece_type() == PieceType::KING) {
-			is_check = true;
-			return IterationStatus::BREAK;
-		}
-		return IterationStatus::CONTINUE;
-	}, false);
 	if (is_check)
 		return GameStatus::WIN;
 	else
 		return GameStatus::DRAW;
 }
 
-int evaluate_board(ChessGame* game) {
+int evaluate_board(Position* game) {
 	++boards_evaluated;
 
-	int result = 0;
+	int result = game->state.material;
 
 	bool is_early_stage = pieces_on_board_count(game) > 24;
 
-	for (uint8_t i = 0; i < 8 * 8; ++i) {
-		Piece piece = game->board[i];
-		if (piece.type() == PieceType::NONE)
-			continue;
-
-		int16_t piece_value = 0;
-
-		switch (piece.type()) {
-		case PieceType::PAWN: {
-			piece_value = 1;
-		} break;
-		case PieceType::BISHOP: {
-			piece_value = 3;
-		} break;
-		case PieceType::KNIGHT: {
-			piece_value = 3;
-		} break;
-		case PieceType::ROOK: {
-			piece_value = 5;
-		} break;
-		case PieceType::QUEEN: {
-			piece_value = 9;
-		} break;
-		case PieceType::KING: {
-			piece_value = 100;
+	for (int team = Team::WHITE; team <= Team::BLACK; ++team) {
+		int team_value = 0;
+		uint8_t king = index_of_king(game, (Team)team);
+		if (king != NOT_FOUND) {
+			team_value += 100;
 
 			// In early stage we consider the king being in the corners as a good thing
 			// and the opposite in late stage.
-			uint8_t col = i % 8;
-			uint8_t row = i / 8;
+			uint8_t col = king % 8;
+			uint8_t row = king / 8;
 			if (is_early_stage) {
-				piece_value += (absolute_value(col - 3) + absolute_value(row - 3)) / 2;
+				team_value += (absolute_value(col - 3) + absolute_value(row - 3)) / 2;
 			} else {
-				piece_value -= (absolute_value(col - 3) + absolute_value(row - 3)) / 2;
+				team_value -= (absolute_value(col - 3) + absolute_value(row - 3)) / 2;
 			}
-		} break;
 		}
 
-		if (piece.team() == Team::BLACK)
-			piece_value = -piece_value;
+		if (team == Team::BLACK)
+			team_value = -team_value;
 
-		result += piece_value;
+		result += team_value;
 	}
 
 	return result;
@@ -789,45 +2027,244 @@ inline int max(int a, int b) {
 	return a > b ? a : b;
 }
 
-int minimax(ChessGame* game, Move move, bool is_max_player, int8_t depth, int alpha, int beta) {
+static constexpr auto MAX_PLY = 64;
+
+// What the search keeps for one ply, the node reached by move.
+struct SearchStackEntry
+{
+	int ply;
+	Move move;
+	// Only set where the node is evaluated.
+	int static_eval;
+	// Quiet moves that caused a cutoff at this ply, most recent first.
+	Move killers[2];
+	UndoRecord undo;
+};
+
+// The search's scratch space, one entry per ply from the root. Each
+// search owns its own stack, so searches do not share any state.
+struct SearchStack
+{
+	SearchStackEntry entries[MAX_PLY];
+};
+
+void init_search_stack(SearchStack* stack) {
+	for (int ply = 0; ply < MAX_PLY; ++ply) {
+		stack->entries[ply] = SearchStackEntry{};
+		stack->entries[ply].ply = ply;
+	}
+}
+
+// Captures and promotions, looked at before the move is made.
+inline bool is_capture(Position* game, Move move) {
+	return game->board[move.destination()].type() != PieceType::NONE
+		|| move.kind() == MoveKind::EN_PASSANT || move.kind() == MoveKind::PROMOTION;
+}
+
+void store_killer(Position* game, SearchStackEntry* ss, Move move) {
+	if (is_capture(game, move) || ss->killers[0] == move)
+		return;
+	ss->killers[1] = ss->killers[0];
+	ss->killers[0] = move;
+}
+
+enum class PickStage
+{
+	HASH_MOVE,
+	GENERATE_CAPTURES,
+	CAPTURES,
+	KILLERS,
+	GENERATE_QUIETS,
+	QUIETS,
+	DONE,
+};
+
+// Hands out the moves of a position lazily, best candidates first: the
+// hash move before anything is generated, then captures by MVV-LVA, then
+// killers and finally the remaining quiet moves, which are only generated
+// when no earlier move caused a cutoff.
+struct MovePicker
+{
+	Position* game;
+	PickStage stage;
+	Move hash_move;
+	Move killers[2];
+	int killer_index;
+	MoveList moves;
+	int cursor;
+};
+
+void init_move_picker(MovePicker* picker, Position* game, Move hash_move, const Move killers[2]) {
+	picker->game = game;
+	picker->stage = PickStage::HASH_MOVE;
+	picker->hash_move = hash_move;
+	picker->killers[0] = killers ? killers[0] : NO_MOVE;
+	picker->killers[1] = killers ? killers[1] : NO_MOVE;
+	picker->killer_index = 0;
+	picker->cursor = 0;
+}
+
+// Most valuable victim first, least valuable attacker breaking ties.
+int score_capture(Position* game, Move move) {
+	int score = 0;
+	Piece victim = game->board[move.destination()];
+	if (victim.type() != PieceType::NONE)
+		score += piece_values[type_index(victim.type())] * 16;
+	else if (move.kind() == MoveKind::EN_PASSANT)
+		score += piece_values[type_index(PieceType::PAWN)] * 16;
+	if (move.kind() == MoveKind::PROMOTION)
+		score += piece_values[type_index(move.promotion_type())] * 16;
+	return score - piece_values[type_index(game->board[move.source()].type())];
+}
+
+bool pick_next_move(MovePicker* picker, Move* out_move) {
+	MoveList& moves = picker->moves;
+	switch (picker->stage) {
+	case PickStage::HASH_MOVE: {
+		picker->stage = PickStage::GENERATE_CAPTURES;
+		if (picker->hash_move != NO_MOVE && is_legal_move(picker->game, picker->hash_move)) {
+			*out_move = picker->hash_move;
+			return true;
+		}
+	} // Fall through.
+
+	case PickStage::GENERATE_CAPTURES: {
+		generate_moves<GenType::CAPTURES>(picker->game, moves);
+		for (ScoredMove& scored : moves)
+			scored.score = score_capture(picker->game, scored.move);
+		picker->stage = PickStage::CAPTURES;
+	} // Fall through.
+
+	case PickStage::CAPTURES: {
+		while (picker->cursor < moves.size) {
+			int best = picker->cursor;
+			for (int i = picker->cursor + 1; i < moves.size; ++i)
+				if (moves[i].score > moves[best].score)
+					best = i;
+			ScoredMove picked = moves[best];
+			moves[best] = moves[picker->cursor];
+			moves[picker->cursor++] = picked;
+			if (picked.move != picker->hash_move) {
+				*out_move = picked.move;
+				return true;
+			}
+		}
+		picker->stage = PickStage::KILLERS;
+	} // Fall through.
+
+	case PickStage::KILLERS: {
+		while (picker->killer_index < 2) {
+			Move killer = picker->killers[picker->killer_index++];
+			// A killer that captures here came out of the captures already.
+			if (killer != NO_MOVE && killer != picker->hash_move && !is_capture(picker->game, killer)
+				&& is_legal_move(picker->game, killer)) {
+				*out_move = killer;
+				return true;
+			}
+		}
+		picker->stage = PickStage::GENERATE_QUIETS;
+	} // Fall through.
+
+	case PickStage::GENERATE_QUIETS: {
+		generate_moves<GenType::QUIETS>(picker->game, moves);
+		picker->stage = PickStage::QUIETS;
+	} // Fall through.
+
+	case PickStage::QUIETS: {
+		while (picker->cursor < moves.size) {
+			Move move = moves[picker->cursor++].move;
+			// Killers that were legal have already been played.
+			if (move != picker->hash_move && move != picker->killers[0] && move != picker->killers[1]) {
+				*out_move = move;
+				return true;
+			}
+		}
+		picker->stage = PickStage::DONE;
+	} // Fall through.
+
+	case PickStage::DONE:
+		break;
+	}
+	return false;
+}
+
+// With CopyMake, every ply plays its move on a copy of the parent position
+// and simply drops it afterwards; otherwise the move is made and unmade on
+// the one position the whole search shares.
+template<bool CopyMake>
+int minimax(Position* parent, Move move, bool is_max_player, int8_t depth, int alpha, int beta, SearchStackEntry* ss) {
 	int result;
-	performe_move(game, move);
-	if (depth <= 0)
+	bool is_quiet = !is_capture(parent, move);
+	Position copy;
+	Position* game = parent;
+	if (CopyMake) {
+		copy = *parent;
+		game = &copy;
+	}
+	ss->move = move;
+	make_move(game, move, CopyMake ? nullptr : &ss->undo);
+	if (depth <= 0 || ss->ply >= MAX_PLY - 1) {
 		result = evaluate_board(game);
-	else {
-		if (!move.flags & MoveFlags::ATTACK) {
+		ss->static_eval = result;
+	} else {
+		if (is_quiet) {
 			depth -= 1;
 		}
 
+		MovePicker picker;
+		init_move_picker(&picker, game, NO_MOVE, ss->killers);
+		Move next_move;
+		bool has_moves = false;
 		if (is_max_player) {
 			result = std::numeric_limits<int>::min();
-			foreach_team_legal_move(game, game->current_turn,
-				[&alpha, &beta, &result, game, depth](Move move)
-			{
-				result = max(result, minimax(game, move, false, depth - 1, alpha, beta));
+			while (pick_next_move(&picker, &next_move)) {
+				has_moves = true;
+				result = max(result, minimax<CopyMake>(game, next_move, false, depth - 1, alpha, beta, ss + 1));
 				alpha = max(result, alpha);
-				if (alpha >= beta)
-					return IterationStatus::BREAK;
-				return IterationStatus::CONTINUE;
-			}, true);
+				if (alpha >= beta) {
+					store_killer(game, ss, next_move);
+					break;
+				}
+			}
 		} else {
 			result = std::numeric_limits<int>::max();
-			foreach_team_legal_move(game, game->current_turn,
-				[&alpha, &beta, &result, game, depth](Move move)
-			{
-				result = min(result, minimax(game, move, true, depth - 1, alpha, beta));
+			while (pick_next_move(&picker, &next_move)) {
+				has_moves = true;
+				result = min(result, minimax<CopyMake>(game, next_move, true, depth - 1, alpha, beta, ss + 1));
 				beta = min(result, beta);
-				if (alpha >= beta)
-					return IterationStatus::BREAK;
-				return IterationStatus::CONTINUE;
-			}, true);
+				if (alpha >= beta) {
+					store_killer(game, ss, next_move);
+					break;
+				}
+			}
+		}
+		// Without a move, a mate keeps the worst score and a stalemate is even.
+		if (!has_moves) {
+			Team them = game->current_turn == Team::WHITE ? Team::BLACK : Team::WHITE;
+			if (!is_square_attacked(game, game->king_squares[game->current_turn], them))
+				result = 0;
 		}
 	}
-	undo_last_move(game);
+	if (!CopyMake)
+		unmake_move(game, move, &ss->undo);
 
 	return result;
 }
 
+// Which of the two minimax variants get_best_next_move searches with.
+static bool use_copy_make = false;
+
+// Searches the position after one of the root's moves; entry 0 of the
+// stack stands for the root itself.
+int search_move(Position* game, Move move, int depth, SearchStack* stack) {
+	using limits = std::numeric_limits<int>;
+	bool is_max_player = game->current_turn != Team::WHITE;
+	SearchStackEntry* ss = &stack->entries[1];
+	if (use_copy_make)
+		return minimax<true>(game, move, is_max_player, depth, limits::min(), limits::max(), ss);
+	return minimax<false>(game, move, is_max_player, depth, limits::min(), limits::max(), ss);
+}
+
 inline bool greater_than(int a, int b) {
 	return a > b;
 }
@@ -851,6 +2288,8 @@ Move get_best_next_move(ChessGame* game, int depth) {
 	}
 
 	boards_evaluated = 0;
+	SearchStack stack;
+	init_search_stack(&stack);
 
 	// HACK!!! :( 
 	// Because sometimes (observed in end of games, so far)
@@ -859,10 +2298,11 @@ Move get_best_next_move(ChessGame* game, int depth) {
 	// so we choose randomly in case of two moves with equal score.
 	srand(time(nullptr));
 	int equal_moves_considerd = 0;
-	foreach_team_legal_move(game, game->current_turn,
-		[is_better_predicate, &equal_moves_considerd, &best_move, &best_move_score, game, depth](Move move)
-	{
-		int move_score = minimax(game, move, game->current_turn != Team::WHITE, depth, limits::min(), limits::max());
+	MoveList moves;
+	generate_moves(game, moves);
+	for (ScoredMove& scored : moves) {
+		Move move = scored.move;
+		int move_score = search_move(game, move, depth, &stack);
 		if (is_better_predicate(move_score, best_move_score)) {
 			best_move_score = move_score;
 			best_move = move;
@@ -871,9 +2311,8 @@ Move get_best_next_move(ChessGame* game, int depth) {
 			best_move_score = move_score;
 			best_move = move;
 		}
-		return IterationStatus::CONTINUE;
-	}, true);
-	printf("Evaluated boards: %llu\n", boards_evaluated);
+	}
+	printf("Evaluated boards: %llu\n", (unsigned long long)boards_evaluated);
 	printf("Best move: ");
 	print_move(best_move);
 	printf("With score: %d\n", best_move_score);
@@ -881,27 +2320,71 @@ Move get_best_next_move(ChessGame* game, int depth) {
 	return best_move;
 }
 
+// Searches the current position once with make/unmake and once with
+// copy-make, then runs perft with its last ply played and counted, and
+// reports how long each took.
+void run_search_benchmark(ChessGame* game, int depth) {
+	bool was_copy_make = use_copy_make;
+	SearchStack stack;
+	MoveList moves;
+	generate_moves(game, moves);
+	for (int mode = 0; mode < 2; ++mode) {
+		use_copy_make = mode == 1;
+		init_search_stack(&stack);
+		boards_evaluated = 0;
+		clock_t start = clock();
+		for (ScoredMove& scored : moves)
+			search_move(game, scored.move, depth, &stack);
+		double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+		printf("%-13s %llu boards in %.3fs (%.0f boards/s)\n", use_copy_make ? "Copy-make:" : "Make/unmake:",
+			(unsigned long long)boards_evaluated, seconds, seconds > 0 ? boards_evaluated / seconds : 0.0);
+	}
+	for (int mode = 0; mode < 2; ++mode) {
+		clock_t start = clock();
+		uint64_t nodes = mode == 0 ? perft<false>(game, 4) : perft<true>(game, 4);
+		double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+		printf("%-13s %llu perft 4 leaves in %.3fs\n", mode == 0 ? "Played:" : "Counted:", (unsigned long long)nodes, seconds);
+	}
+	printf("Position size: %d bytes, attack maps with %s fills.\n", (int)sizeof(Position), use_avx2 ? "AVX2" : "scalar");
+	use_copy_make = was_copy_make;
+}
+
 bool full_test(ChessGame* game, Move move, int depth) {
 	Piece board_copy[8 * 8];
-	GameFlags flags_copy = game->flags;
+	Bitboard pieces_by_type_copy[PIECE_TYPES_COUNT];
+	Bitboard pieces_by_team_copy[2];
+	uint8_t piece_counts_copy[2][PIECE_TYPES_COUNT];
+	uint8_t king_squares_copy[2];
+	IrreversibleState state_copy = game->state;
 	memcpy(board_copy, game->board, sizeof(Piece) * 8 * 8);
+	memcpy(pieces_by_type_copy, game->pieces_by_type, sizeof(pieces_by_type_copy));
+	memcpy(pieces_by_team_copy, game->pieces_by_team, sizeof(pieces_by_team_copy));
+	memcpy(piece_counts_copy, game->piece_counts, sizeof(piece_counts_copy));
+	memcpy(king_squares_copy, game->king_squares, sizeof(king_squares_copy));
 
 	performe_move(game, move);
+	bool is_key_right = game->state.key == compute_key(game)
+		&& game->state.pawn_key == compute_pawn_key(game)
+		&& game->state.material_key == compute_material_key(game);
 
+	bool have_children_passed = true;
 	if (depth != 0) {
-		bool has_yield = foreach_team_legal_move(game, game->current_turn,
-			[game, depth](Move move)
-		{
-			if (full_test(game, move, depth - 1))
-				return IterationStatus::CONTINUE;
-			return IterationStatus::BREAK;
-		}, true);
-		if (has_yield)
-			return false;
+		MoveList moves;
+		generate_moves(game, moves);
+		for (ScoredMove& scored : moves)
+			if (!full_test(game, scored.move, depth - 1)) {
+				have_children_passed = false;
+				break;
+			}
 	}
 
 	undo_last_move(game);
 
+	if (!is_key_right) {
+		printf("-------------------\n");
+		printf("Incremental keys differ from the recomputed ones after the move:\n");
+		print_move(move);
+	}
 	bool is_equal = memcmp(board_copy, game->board, sizeof(Piece) * 8 * 8) == 0;
 	if (!is_equal) {
 		printf("-------------------\n");
@@ -912,13 +2395,69 @@ bool full_test(ChessGame* game, Move move, int depth) {
 		print_move(move);
 		printf("In depth %d.\n", depth);
 	}
-	if (flags_copy != game->flags) {
+	if (state_copy.flags != game->state.flags) {
 		is_equal = false;
 		printf("-------------------\n");
 		printf("Flags inequality!\n");
-		printf("Excpected: %d, Got: %d.\n", flags_copy, game->flags);
+		printf("Excpected: %d, Got: %d.\n", state_copy.flags, game->state.flags);
+	}
+	if (state_copy.en_passant_square != game->state.en_passant_square
+		|| state_copy.halfmove_clock != game->state.halfmove_clock
+		|| state_copy.material != game->state.material
+		|| state_copy.key != game->state.key
+		|| state_copy.pawn_key != game->state.pawn_key
+		|| state_copy.material_key != game->state.material_key) {
+		is_equal = false;
+		printf("-------------------\n");
+		printf("En passant square, halfmove clock, material or keys inequality!\n");
+		game->state = state_copy;
+	}
+	if (memcmp(pieces_by_type_copy, game->pieces_by_type, sizeof(pieces_by_type_copy)) != 0
+		|| memcmp(pieces_by_team_copy, game->pieces_by_team, sizeof(pieces_by_team_copy)) != 0
+		|| memcmp(piece_counts_copy, game->piece_counts, sizeof(piece_counts_copy)) != 0
+		|| memcmp(king_squares_copy, game->king_squares, sizeof(king_squares_copy)) != 0) {
+		is_equal = false;
+		printf("-------------------\n");
+		printf("Bitboards or piece counts inequality!\n");
+		sync_board_state(game);
 	}
-	return is_equal;
+	return is_equal && is_key_right && have_children_passed;
+}
+
+// Prints the number of leaves perft finds under each move of the position
+// when divide is set, then the total and the speed. Uses perft_table when
+// it has been given a size, and perft_settings.threads threads.
+void run_perft(Position* game, int depth, bool divide) {
+	clear_perft_table();
+	auto start = std::chrono::steady_clock::now();
+	uint64_t nodes = 0;
+	if ((divide || perft_settings.threads > 1) && depth > 1) {
+		MoveList moves;
+		generate_moves(game, moves);
+		uint64_t move_nodes[MAX_MOVES];
+		perft_root_moves(game, depth, moves, move_nodes);
+		for (int i = 0; i < moves.size; ++i) {
+			if (divide) {
+				char text[8];
+				move_to_string(moves[i].move, text);
+				printf("%s: %llu\n", text, (unsigned long long)move_nodes[i]);
+			}
+			nodes += move_nodes[i];
+		}
+	} else if (divide && depth == 1) {
+		MoveList moves;
+		generate_moves(game, moves);
+		for (ScoredMove& scored : moves) {
+			char text[8];
+			move_to_string(scored.move, text);
+			printf("%s: 1\n", text);
+		}
+		nodes = moves.size;
+	} else
+		nodes = perft_hashed(game, depth);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("Nodes: %llu\n", (unsigned long long)nodes);
+	printf("Time: %.3fs (%.0f nodes/s)\n", seconds, seconds > 0 ? nodes / seconds : 0.0);
 }
 
 void print_game_flags(GameFlags flags) {
@@ -933,13 +2472,13 @@ void print_game_flags(GameFlags flags) {
 }
 
 void print_history(MoveHistory* history) {
-	for (int i = 0; i < history->cursor; ++i)
+	for (int i = 0; i < history->size(); ++i)
 		print_move(history->moves[i]);
 }
 
 bool maybe_parse_and_exceute_command(ChessGame* game, const char* input) {
 	if (strcmp(input, "undo") == 0) {
-		if (game->history.cursor <= 1)
+		if (game->history.size() <= 1)
 			return false;
 		undo_last_move(game);
 		if (game->is_against_ai)
@@ -974,32 +2513,81 @@ bool maybe_parse_and_exceute_command(ChessGame* game, const char* input) {
 		}
 		return true;
 	} else if (strcmp(input, "test") == 0) {
-		foreach_team_legal_move(game, game->current_turn,
-			[game](Move move)
-		{
-			performe_move(game, move);
-			undo_last_move(game);
-			return IterationStatus::CONTINUE;
-		}, true);
-		return true;
-	} else if (strcmp(input, "full") == 0) {
-		int levels = 4;
-		printf("Performing full test in %d levels...\n", levels);
+		// Checks that undo restores everything, keys included, three
+		// moves deep from every move of the position.
 		bool has_passed = true;
-		foreach_team_legal_move(game, game->current_turn,
-			[&has_passed, game, levels](Move move)
-		{
-			if (full_test(game, move, levels)) {
+		MoveList moves;
+		generate_moves(game, moves);
+		for (ScoredMove& scored : moves)
+			if (!full_test(game, scored.move, 3)) {
 				has_passed = false;
-				return IterationStatus::CONTINUE;
+				break;
 			}
-			return IterationStatus::BREAK;
-		}, true);
 		if (has_passed)
 			printf("Test passed successfully!\n");
 		return true;
+	} else if (strcmp(input, "perft") == 0 || strcmp(input, "divide") == 0) {
+		int depth;
+		printf("Enter depth: ");
+		if (scanf_s("%d", &depth) != 1 || depth < 0 || depth > MAX_PLY) {
+			printf("Invalid depth!\n");
+			scanf_s("%*[^\n]");
+			return true;
+		}
+		run_perft(game, depth, strcmp(input, "divide") == 0);
+		return true;
+	} else if (strcmp(input, "hash") == 0) {
+		int megabytes;
+		printf("Enter perft table size in MB (0 for none): ");
+		if (scanf_s("%d", &megabytes) != 1 || megabytes < 0 || megabytes > 65536) {
+			printf("Invalid size!\n");
+			scanf_s("%*[^\n]");
+			return true;
+		}
+		if (!resize_perft_table(megabytes))
+			printf("Not enough memory, the table is unchanged.\n");
+		printf("Perft table: %llu entries.\n", (unsigned long long)perft_table.entries.size());
+		return true;
+	} else if (strcmp(input, "threads") == 0) {
+		int threads, split_depth;
+		printf("Enter perft thread count: ");
+		if (scanf_s("%d", &threads) != 1 || threads < 1 || threads > 1024) {
+			printf("Invalid thread count!\n");
+			scanf_s("%*[^\n]");
+			return true;
+		}
+		printf("Enter split depth (1 to %d): ", MAX_PERFT_SPLIT_DEPTH);
+		if (scanf_s("%d", &split_depth) != 1 || split_depth < 1 || split_depth > MAX_PERFT_SPLIT_DEPTH) {
+			printf("Invalid split depth!\n");
+			scanf_s("%*[^\n]");
+			return true;
+		}
+		perft_settings.threads = threads;
+		perft_settings.split_depth = split_depth;
+		return true;
+	} else if (strcmp(input, "bench") == 0) {
+		run_search_benchmark(game, SEARCH_DEPTH - 2);
+		return true;
+	} else if (strcmp(input, "copy") == 0) {
+		use_copy_make = !use_copy_make;
+		printf("Searching with %s.\n", use_copy_make ? "copy-make" : "make/unmake");
+		return true;
+	} else if (strcmp(input, "fen") == 0) {
+		char fen[128];
+		printf("Enter FEN: ");
+		// Also takes a FEN typed on the same line as the command.
+		do {
+			if (!fgets(fen, sizeof(fen), stdin))
+				return true;
+			fen[strcspn(fen, "\r\n")] = '\0';
+		} while (fen[strspn(fen, " \t")] == '\0');
+		if (load_fen(game, fen))
+			game->history.clear();
+		else
+			printf("Invalid FEN!\n");
+		return true;
 	} else if (strcmp(input, "flag") == 0) {
-		print_game_flags(game->flags);
+		print_game_flags(game->state.flags);
 		return true;
 	} else if (strcmp(input, "hist") == 0) {
 		print_history(&game->history);
@@ -1012,7 +2600,7 @@ bool maybe_parse_and_exceute_command(ChessGame* game, const char* input) {
 
 void game_loop(ChessGame* game) {
 	GameStatus status = GameStatus::CONTINUE;
-	char input[5] = { 0 };
+	char input[8] = { 0 };
 	while (status == GameStatus::CONTINUE) {
 		Move move;
 		while (true) {
@@ -1024,7 +2612,7 @@ void game_loop(ChessGame* game) {
 				break;
 			} else {
 				printf("Enter move instruction (like 'b2d2'):\n");
-				scanf_s("%s", &input, 5);
+				scanf_s("%s", &input, 8);
 
 				if (maybe_parse_and_exceute_command(game, input))
 					continue;
@@ -1047,7 +2635,7 @@ void game_loop(ChessGame* game) {
 	if (status == GameStatus::WIN) {
 		printf("Checkmate!\n");
 		printf("Enter 'hist' to print the game's history, anything else to exit: ");
-		scanf_s("%s", input, 5);
+		scanf_s("%s", input, 8);
 		if (input == "hist")
 			print_history(&game->history);
 	} else {
@@ -1056,6 +2644,8 @@ void game_loop(ChessGame* game) {
 }
 
 int main() {
+	init_attack_tables();
+	init_zobrist();
 	ChessGame cg;
 	init_game(&cg);
 	game_loop(&cg);